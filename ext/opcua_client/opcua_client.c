@@ -1,764 +1,4705 @@
 #include <ruby.h>
+#include <ruby/thread.h>
+#include <ruby/thread_native.h>
+#include <ruby/encoding.h>
 #include "open62541.h"
 
+#ifdef RB_THREAD_LOCAL_SPECIFIER
+#define OPCUA_THREAD_LOCAL RB_THREAD_LOCAL_SPECIFIER
+#elif defined(_MSC_VER)
+#define OPCUA_THREAD_LOCAL __declspec(thread)
+#else
+#define OPCUA_THREAD_LOCAL __thread
+#endif
+
+/* Longest single wait on the socket while the GVL is released. An interrupted
+ * call (Thread#raise, Timeout) is noticed after at most this many ms. */
+#define INTERRUPT_CHECK_INTERVAL_MS 10
+
+#define DEFAULT_MONITORING_CYCLE_TIMEOUT_MS 1000
+
+/* Large reads and writes are split into requests of at most this many nodes
+ * (or the server's MaxNodesPerRead/MaxNodesPerWrite if lower), and up to
+ * MAX_PIPELINED_REQUESTS of them are on the wire at once. */
+#define DEFAULT_MAX_NODES_PER_REQUEST 1000
+#define MAX_PIPELINED_REQUESTS 8
+
+/* When the server limits the size of a request, a slice leaves this much room
+ * for the headers around its nodes, and each chunk of the message has a
+ * header of CHUNK_HEADER_SIZE bytes. */
+#define REQUEST_HEADERS_SIZE 1024
+#define CHUNK_HEADER_SIZE 24
+
+/* add_monitored_items creates at most this many items per request (or the
+ * server's MaxMonitoredItemsPerCall if lower) */
+#define DEFAULT_MAX_MONITORED_ITEMS_PER_REQUEST 2000
+
+/* Values staged for a write are laid out at this alignment */
+#define STAGING_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+/* Type argument of rb_readUaValue accepting a value of any type */
+#define ANY_UA_TYPE -1
+
 VALUE cClient;
 VALUE cError;
+VALUE cReadPlan;
+VALUE cNodeId;
+VALUE cFuture;
 VALUE mOPCUAClient;
 
 struct UninitializedClient {
     UA_Client *client;
 };
 
-struct OpcuaClientContext {
-    VALUE rubyClientInstance;
+/* A ReadRequest built once and sent by every client.read(plan). The binary
+ * encoding of everything after the request header is cached per
+ * timestampsToReturn value, so repeated reads only encode the header. */
+struct ReadPlan {
+    UA_ReadRequest request;
+    UA_ByteString encodedBodies[UA_TIMESTAMPSTORETURN_NEITHER + 1];
+
+    /* With register: true the request carries the aliases returned by
+     * RegisterNodes, which are valid for one session only. Such a plan is
+     * bound to the client that used it first. */
+    int registerNodes;
+    UA_NodeId *nodeIds; /* the nodes as given, registered again for a new session */
+    VALUE registeredClient;
+    size_t registeredSession;
 };
 
-static VALUE toRubyTime(UA_DateTime raw_date) {
-    UA_DateTimeStruct dts = UA_DateTime_toStruct(raw_date);
-    VALUE year = UINT2NUM(dts.year);
-    VALUE month = UINT2NUM(dts.month);
-    VALUE day = UINT2NUM(dts.day);
-    VALUE hour = UINT2NUM(dts.hour);
-    VALUE min = UINT2NUM(dts.min);
-    VALUE sec = UINT2NUM(dts.sec);
-    VALUE millis = UINT2NUM(dts.milliSec);
-    VALUE cDate = rb_const_get(rb_cObject, rb_intern("Time"));
-    VALUE rb_date = rb_funcall(cDate, rb_intern("gm"), 7, year, month, day, hour, min, sec, millis);
-    return rb_date;
+/* Hash map from NodeIds to fixed-size values, with open addressing. The
+ * map keeps its own copies of the NodeIds. */
+struct NodeMap {
+    size_t valueSize;
+    size_t capacity; /* slots, a power of two */
+    size_t size;
+    UA_Byte *slots;
+};
+
+struct NodeMapSlot {
+    UA_NodeId nodeId;
+    UA_UInt32 hash;
+    UA_Boolean used;
+    /* followed by the value, at STAGING_ALIGN */
+};
+
+#define NODE_MAP_SLOT_HEADER STAGING_ALIGN(sizeof(struct NodeMapSlot))
+
+static size_t nodeMapSlotSize(const struct NodeMap *map) {
+    return NODE_MAP_SLOT_HEADER + STAGING_ALIGN(map->valueSize);
 }
 
-static void
-handler_dataChanged(UA_Client *client, UA_UInt32 subId, void *subContext,
-                           UA_UInt32 monId, void *monContext, UA_DataValue *value) {
+static struct NodeMapSlot *nodeMapSlot(const struct NodeMap *map, size_t i) {
+    return (struct NodeMapSlot *)(map->slots + i * nodeMapSlotSize(map));
+}
 
-    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
-    VALUE self = ctx->rubyClientInstance;
-    VALUE callback = rb_ivar_get(self, rb_intern("@callback_after_data_changed"));
+static void *nodeMapSlotValue(struct NodeMapSlot *slot) {
+    return (UA_Byte *)slot + NODE_MAP_SLOT_HEADER;
+}
 
-    if (NIL_P(callback)) {
-        return;
+/* The slot of nodeId, or the free slot where it belongs */
+static struct NodeMapSlot *nodeMapFind(const struct NodeMap *map, const UA_NodeId *nodeId, UA_UInt32 hash) {
+    size_t mask = map->capacity - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct NodeMapSlot *slot = nodeMapSlot(map, i);
+
+        if (!slot->used || (slot->hash == hash && UA_NodeId_equal(&slot->nodeId, nodeId))) {
+            return slot;
+        }
     }
+}
 
-    VALUE v_serverTime = Qnil;
-    if (value->hasServerTimestamp) {
-        v_serverTime = toRubyTime(value->serverTimestamp);
+static void *nodeMapGet(const struct NodeMap *map, const UA_NodeId *nodeId) {
+    if (map->size == 0) {
+        return NULL;
     }
 
-    VALUE v_sourceTime = Qnil;
-    if (value->hasSourceTimestamp) {
-        v_sourceTime = toRubyTime(value->sourceTimestamp);
+    struct NodeMapSlot *slot = nodeMapFind(map, nodeId, UA_NodeId_hash(nodeId));
+    return slot->used ? nodeMapSlotValue(slot) : NULL;
+}
+
+static int nodeMapGrow(struct NodeMap *map) {
+    struct NodeMap grown = *map;
+    grown.capacity = map->capacity ? map->capacity * 2 : 64;
+    grown.slots = UA_calloc(grown.capacity, nodeMapSlotSize(map));
+
+    if (!grown.slots) {
+        return 0;
     }
 
-    VALUE params = rb_ary_new();
-    rb_ary_push(params, UINT2NUM(subId));
-    rb_ary_push(params, UINT2NUM(monId));
-    rb_ary_push(params, v_serverTime);
-    rb_ary_push(params, v_sourceTime);
+    for (size_t i=0; i<map->capacity; i++) {
+        struct NodeMapSlot *slot = nodeMapSlot(map, i);
 
-    VALUE v_newValue = Qnil;
-
-    if(UA_Variant_hasScalarType(&value->value, &UA_TYPES[UA_TYPES_DATETIME])) {
-        UA_DateTime raw_date = *(UA_DateTime *) value->value.data;
-        v_newValue = toRubyTime(raw_date);
-    } else if (UA_Variant_hasScalarType(&value->value, &UA_TYPES[UA_TYPES_INT32])) {
-        UA_Int32 number = *(UA_Int32 *) value->value.data;
-        v_newValue = INT2NUM(number);
-    } else if (UA_Variant_hasScalarType(&value->value, &UA_TYPES[UA_TYPES_INT16])) {
-        UA_Int16 number = *(UA_Int16 *) value->value.data;
-        v_newValue = INT2NUM(number);
-    } else if (UA_Variant_hasScalarType(&value->value, &UA_TYPES[UA_TYPES_BOOLEAN])) {
-        UA_Boolean b = *(UA_Boolean *) value->value.data;
-        v_newValue = b ? Qtrue : Qfalse;
-    } else if (UA_Variant_hasScalarType(&value->value, &UA_TYPES[UA_TYPES_FLOAT])) {
-        UA_Float dbl = *(UA_Float *) value->value.data;
-        v_newValue = DBL2NUM(dbl);
+        if (slot->used) {
+            memcpy(nodeMapFind(&grown, &slot->nodeId, slot->hash), slot, nodeMapSlotSize(map));
+        }
     }
 
-    rb_ary_push(params, v_newValue);
-    rb_proc_call(callback, params);
+    UA_free(map->slots);
+    *map = grown;
+    return 1;
 }
 
-static void
-deleteSubscriptionCallback(UA_Client *client, UA_UInt32 subscriptionId, void *subscriptionContext) {
-    // printf("Subscription Id %u was deleted\n", subscriptionId);
-}
+/* The value of nodeId, zeroed if the node was not in the map yet. NULL if
+ * out of memory. */
+static void *nodeMapPut(struct NodeMap *map, const UA_NodeId *nodeId) {
+    if ((map->size + 1) * 4 > map->capacity * 3 && !nodeMapGrow(map)) {
+        return NULL;
+    }
 
-static void
-subscriptionInactivityCallback(UA_Client *client, UA_UInt32 subscriptionId, void *subContext) {
-    // printf("Inactivity for subscription %u", subscriptionId);
-}
+    UA_UInt32 hash = UA_NodeId_hash(nodeId);
+    struct NodeMapSlot *slot = nodeMapFind(map, nodeId, hash);
 
-static void
-stateCallback (UA_Client *client, UA_ClientState clientState) {
-    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    if (!slot->used) {
+        if (UA_NodeId_copy(nodeId, &slot->nodeId) != UA_STATUSCODE_GOOD) {
+            return NULL;
+        }
+        slot->hash = hash;
+        slot->used = true;
+        memset(nodeMapSlotValue(slot), 0, map->valueSize);
+        map->size++;
+    }
 
-    switch(clientState) {
-        case UA_CLIENTSTATE_DISCONNECTED:
-            ; // printf("%s\n", "The client is disconnected");
-            break;
-        case UA_CLIENTSTATE_CONNECTED:
-            ; // printf("%s\n", "A TCP connection to the server is open");
-            break;
-        case UA_CLIENTSTATE_SECURECHANNEL:
-            ; // printf("%s\n", "A SecureChannel to the server is open");
-            break;
-        case UA_CLIENTSTATE_SESSION:
-            ; // printf("%s\n", "A new session was created!");
-            VALUE self = ctx->rubyClientInstance;
+    return nodeMapSlotValue(slot);
+}
 
-            VALUE callback = rb_ivar_get(self, rb_intern("@callback_after_session_created"));
-            if (!NIL_P(callback)) {
-                VALUE params = rb_ary_new();
-                rb_ary_push(params, self);
-                rb_proc_call(callback, params); // rescue?
-            }
+/* Empties the map, calling freeValue (if any) on every value */
+static void nodeMapClear(struct NodeMap *map, void (*freeValue)(void *value)) {
+    for (size_t i=0; i<map->capacity; i++) {
+        struct NodeMapSlot *slot = nodeMapSlot(map, i);
 
-            break;
-        case UA_CLIENTSTATE_SESSION_RENEWED:
-            /* The session was renewed. We don't need to recreate the subscription. */
-            break;
+        if (slot->used) {
+            UA_NodeId_deleteMembers(&slot->nodeId);
+            if (freeValue) {
+                freeValue(nodeMapSlotValue(slot));
+            }
+        }
     }
-    return;
-}
 
-static VALUE raise_invalid_arguments_error() {
-    rb_raise(cError, "Invalid arguments");
-    return Qnil;
+    UA_free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->size = 0;
 }
 
-static VALUE raise_ua_status_error(UA_StatusCode status) {
-    rb_raise(cError, "%u: %s", status, UA_StatusCode_name(status));
-    return Qnil;
+/* DataType and ValueRank attributes of a node, as cached in nodeTypes */
+struct NodeType {
+    int writableType; /* -1 if the DataType is not a writable built-in type */
+    UA_Int32 valueRank;
+};
+
+static void freeShadowValue(void *value) {
+    UA_Variant_deleteMembers(value);
 }
 
-static void UA_Client_free(void *self) {
-    // printf("free client\n");
-    struct UninitializedClient *uclient = self;
+/* Whether two variants hold the same value with the same type */
+static int variantsEqual(const UA_Variant *a, const UA_Variant *b) {
+    if (a->type != b->type || a->arrayLength != b->arrayLength || UA_Variant_isScalar(a) != UA_Variant_isScalar(b) ||
+        a->arrayDimensionsSize != b->arrayDimensionsSize) {
+        return 0;
+    }
 
-    if (uclient->client) {
-        struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
-        xfree(ctx);
-        UA_Client_delete(uclient->client);
+    if (!a->type) {
+        return 1;
     }
 
-    xfree(self);
+    if (a->type->pointerFree) {
+        size_t length = UA_Variant_isScalar(a) ? 1 : a->arrayLength;
+        return length == 0 || memcmp(a->data, b->data, length * a->type->memSize) == 0;
+    }
+
+    if (a->type != &UA_TYPES[UA_TYPES_STRING] && a->type != &UA_TYPES[UA_TYPES_BYTESTRING] &&
+        a->type != &UA_TYPES[UA_TYPES_XMLELEMENT]) {
+        return 0; /* not compared, counts as changed */
+    }
+
+    size_t length = UA_Variant_isScalar(a) ? 1 : a->arrayLength;
+    for (size_t i=0; i<length; i++) {
+        const UA_String *strA = &((const UA_String *)a->data)[i];
+        const UA_String *strB = &((const UA_String *)b->data)[i];
+
+        if (strA->length != strB->length || (strA->length > 0 && memcmp(strA->data, strB->data, strA->length) != 0)) {
+            return 0;
+        }
+    }
+
+    return 1;
 }
 
-static const rb_data_type_t UA_Client_Type = {
-    "UA_Uninitialized_Client",
-    { 0, UA_Client_free, 0 },
-    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+struct OpcuaClientContext {
+    VALUE rubyClientInstance;
+    int gvlReleased;
+    int callbackState; /* rb_protect state of a callback that raised */
+    size_t dataChanges; /* notifications processed in the current monitoring cycle */
+    size_t sessionCount; /* sessions created so far, identifies the current one */
+    int operationLimitsRead; /* server OperationLimits fetched for this session */
+    UA_UInt32 maxNodesPerRead;
+    UA_UInt32 maxNodesPerWrite;
+    UA_UInt32 maxMonitoredItemsPerCall;
+    UA_UInt32 requestTimeout; /* ms to wait for a response */
+    int deleting; /* UA_Client_delete is running, callbacks must not call Ruby */
+    struct NodeMap nodeTypes; /* struct NodeType of nodes written without a type */
+    int writeIfChanged; /* multiWrite skips values equal to the shadow */
+    struct NodeMap writeShadow; /* UA_Variant last written to each node */
+    size_t writtenItems;
+    size_t skippedItems;
+    int batchDataChanges; /* notifications go to after_data_changed_batch */
+    struct BatchedDataChange *batch; /* notifications of the current PublishResponse */
+    size_t batchSize;
+    size_t batchCapacity;
+    int epochNsTimestamps; /* timestamps as Integer ns since the Unix epoch */
+    VALUE *itemContexts; /* context: of the monitored items, Qnil if unused */
+    size_t itemContextsSize;
+    size_t itemContextsCapacity;
+    size_t *freeItemContexts; /* unused slots of itemContexts */
+    size_t freeItemContextsCount;
+    rb_nativethread_lock_t itemContextsLock; /* slots are freed without the GVL */
+    VALUE lockOwner; /* Thread holding the client lock, Qnil if none */
+    int lockDepth;
+    VALUE lockWaiters; /* Threads waiting for the lock, first come first served */
+    volatile int lockWaiting; /* their count, read by long waits to give way */
+    struct QueuedChange *changeQueue; /* ring buffer for drain_changes, NULL if off */
+    size_t changeQueueCapacity;
+    size_t changeQueueHead; /* oldest entry */
+    size_t changeQueueSize;
+    size_t droppedChanges; /* entries overwritten before they were drained */
+    rb_nativethread_lock_t changeQueueLock; /* drain_changes may run on another thread */
 };
 
-static VALUE allocate(VALUE klass) {
-    // printf("allocate client\n");
-    struct UninitializedClient *uclient = ALLOC(struct UninitializedClient);
-    *uclient = (const struct UninitializedClient){ 0 };
+/* A notification waiting in the change queue. Fixed-size scalars are copied
+ * inline, anything else keeps the variant taken from the response. */
+struct QueuedChange {
+    UA_UInt32 monId;
+    UA_StatusCode status;
+    UA_DateTime serverTime; /* 0 if the server sent none */
+    UA_DateTime sourceTime;
+    const UA_DataType *inlineType; /* NULL if the value is in variant */
+    union {
+        UA_Int64 i;
+        UA_Double d;
+        UA_Byte bytes[8];
+    } inlineValue;
+    UA_Variant variant;
+};
 
-    return TypedData_Wrap_Struct(klass, &UA_Client_Type, uclient);
+struct BatchedDataChange {
+    UA_UInt32 monId;
+    void *monContext;
+    UA_DataValue value;
+};
+
+/* The lock of the client. It is held while the client runs without the GVL
+ * and while the GVL holder touches state shared with such a call, so a client
+ * shared by several threads is used by one at a time. The lock itself is
+ * only changed with the GVL held. Waiting threads sleep (interruptibly) and
+ * get the lock in the order they asked for it. The lock is reentrant, so that
+ * callbacks running on the holding thread can use the client again. */
+static VALUE waitForClientLock(VALUE ptr) {
+    struct OpcuaClientContext *ctx = (struct OpcuaClientContext *)ptr;
+    VALUE thread = rb_thread_current();
+
+    while (ctx->lockOwner != thread) {
+        rb_thread_sleep_forever();
+    }
+
+    ctx->lockDepth = 1;
+    return Qnil;
 }
 
-static VALUE rb_initialize(VALUE self) {
-    struct UninitializedClient * uclient;
-    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+static void unlockClient(struct OpcuaClientContext *ctx);
 
-    UA_ClientConfig customConfig = UA_ClientConfig_default;
-    customConfig.stateCallback = stateCallback;
-    customConfig.subscriptionInactivityCallback = subscriptionInactivityCallback;
+static void leaveClientLockQueue(struct OpcuaClientContext *ctx) {
+    VALUE thread = rb_thread_current();
 
-    struct OpcuaClientContext *ctx = ALLOC(struct OpcuaClientContext);
-    *ctx = (const struct OpcuaClientContext){ 0 };
+    ctx->lockWaiting--;
+    rb_ary_delete(ctx->lockWaiters, thread);
 
-    ctx->rubyClientInstance = self;
-    customConfig.clientContext = ctx;
+    /* Interrupted right after the lock was handed over */
+    if (ctx->lockOwner == thread && ctx->lockDepth == 0) {
+        ctx->lockDepth = 1;
+        unlockClient(ctx);
+    }
+}
 
-    uclient->client = UA_Client_new(customConfig);
+/* The state of an exception (such as Thread#raise) that arrived while the
+ * thread waited for a client, kept until raisePendingInterrupts so that the
+ * caller can free native memory first */
+static OPCUA_THREAD_LOCAL int deferredInterrupt;
 
+static VALUE checkInterrupts(VALUE unused) {
+    rb_thread_check_ints();
     return Qnil;
 }
 
-static VALUE rb_connect(VALUE self, VALUE v_connectionString) {
-    if (RB_TYPE_P(v_connectionString, T_STRING) != 1) {
-        return raise_invalid_arguments_error();
+/* Runs pending interrupts, deferring an exception they raise */
+static int deferInterrupts(void) {
+    int state = 0;
+
+    rb_protect(checkInterrupts, Qnil, &state);
+    if (state) {
+        deferredInterrupt = state;
     }
 
-    char *connectionString = StringValueCStr(v_connectionString);
+    return !state;
+}
 
-    struct UninitializedClient * uclient;
-    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
-    UA_Client *client = uclient->client;
+/* Returns 0 without the lock if an exception is deferred */
+static int tryLockClient(struct OpcuaClientContext *ctx) {
+    VALUE thread = rb_thread_current();
 
-    UA_StatusCode status = UA_Client_connect(client, connectionString);
+    if (deferredInterrupt) {
+        return 0;
+    }
 
-    if (status == UA_STATUSCODE_GOOD) {
-        return Qnil;
+    if (ctx->lockOwner == thread) {
+        ctx->lockDepth++;
+    } else if (NIL_P(ctx->lockOwner)) {
+        ctx->lockOwner = thread;
+        ctx->lockDepth = 1;
     } else {
-        return raise_ua_status_error(status);
+        int state = 0;
+
+        ctx->lockWaiting++;
+        rb_ary_push(ctx->lockWaiters, thread);
+        rb_protect(waitForClientLock, (VALUE)ctx, &state);
+        leaveClientLockQueue(ctx);
+
+        if (state) {
+            deferredInterrupt = state;
+            return 0;
+        }
     }
-}
 
-static VALUE rb_createSubscription(VALUE self) {
-    struct UninitializedClient * uclient;
-    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
-    UA_Client *client = uclient->client;
+    return 1;
+}
 
-    UA_CreateSubscriptionRequest request = UA_CreateSubscriptionRequest_default();
-    UA_CreateSubscriptionResponse response = UA_Client_Subscriptions_create(client, request, NULL, NULL, deleteSubscriptionCallback);
+static void raisePendingInterrupts(struct OpcuaClientContext *ctx);
 
-    if (response.responseHeader.serviceResult == UA_STATUSCODE_GOOD) {
-        UA_UInt32 subscriptionId = response.subscriptionId;
-        return UINT2NUM(subscriptionId);
-    } else {
-        return Qnil;
+static void lockClient(struct OpcuaClientContext *ctx) {
+    if (!tryLockClient(ctx)) {
+        raisePendingInterrupts(ctx);
     }
 }
 
-static VALUE rb_addMonitoredItem(VALUE self, VALUE v_subscriptionId, VALUE v_monNsIndex, VALUE v_monNsName) {
-    struct UninitializedClient * uclient;
-    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
-    UA_Client *client = uclient->client;
-
-    UA_UInt32 subscriptionId = NUM2UINT(v_subscriptionId); // TODO: check type
-    UA_UInt16 monNsIndex = NUM2USHORT(v_monNsIndex); // TODO: check type
-    char* monNsName = StringValueCStr(v_monNsName); // TODO: check type
+/* Hands the lock to the longest waiting thread */
+static void unlockClient(struct OpcuaClientContext *ctx) {
+    if (--ctx->lockDepth > 0) {
+        return;
+    }
 
-    UA_MonitoredItemCreateRequest monRequest = UA_MonitoredItemCreateRequest_default(UA_NODEID_STRING(monNsIndex, monNsName));
+    ctx->lockOwner = Qnil;
 
-    UA_MonitoredItemCreateResult monResponse =
-    UA_Client_MonitoredItems_createDataChange(client, subscriptionId,
-                                              UA_TIMESTAMPSTORETURN_BOTH,
-                                              monRequest, NULL, handler_dataChanged, NULL);
-    if (monResponse.statusCode == UA_STATUSCODE_GOOD) {
-        // printf("Request to monitor field %hu:%s successful, id %u\n", monNsIndex, monNsName, monResponse.monitoredItemId);
-        UA_UInt32 monitoredItemId = monResponse.monitoredItemId;
-        return UINT2NUM(monitoredItemId);
-    } else {
-        // printf("Request to monitor field failed: %s\n", UA_StatusCode_name(monResponse.statusCode));
-        return Qnil;
+    while (NIL_P(ctx->lockOwner) && RARRAY_LEN(ctx->lockWaiters) > 0) {
+        ctx->lockOwner = rb_thread_wakeup_alive(rb_ary_shift(ctx->lockWaiters));
     }
 }
 
-static VALUE rb_disconnect(VALUE self) {
-    struct UninitializedClient * uclient;
-    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
-    UA_Client *client = uclient->client;
+/* A monitored item's context is passed to open62541 as its slot in
+ * itemContexts plus one, NULL meaning none. The slots are marked by
+ * UA_Client_mark and freed by monitoredItemDeleted, or by the add if the
+ * item was not created. */
+static int growItemContexts(struct OpcuaClientContext *ctx) {
+    size_t capacity = ctx->itemContextsCapacity ? ctx->itemContextsCapacity * 2 : 64;
+    VALUE *itemContexts = UA_realloc(ctx->itemContexts, capacity * sizeof(VALUE));
 
-    UA_StatusCode status = UA_Client_disconnect(client);
-    return RB_UINT2NUM(status);
-}
+    if (!itemContexts) {
+        return 0;
+    }
 
-static UA_StatusCode multiRead(UA_Client *client, const UA_NodeId *nodeId, UA_Variant *out, const long varsCount) {
+    ctx->itemContexts = itemContexts;
 
-    UA_UInt16 rvSize = UA_TYPES[UA_TYPES_READVALUEID].memSize;
-    UA_ReadValueId *rValues = UA_calloc(varsCount, rvSize);
+    size_t *freeItemContexts = UA_realloc(ctx->freeItemContexts, capacity * sizeof(size_t));
 
-    for (int i=0; i<varsCount; i++) {
-        UA_ReadValueId *readItem = &rValues[i];
-        readItem->nodeId = nodeId[i];
-        readItem->attributeId = UA_ATTRIBUTEID_VALUE;
+    if (!freeItemContexts) {
+        return 0;
     }
 
-    UA_ReadRequest request;
-    UA_ReadRequest_init(&request);
-    request.nodesToRead = rValues;
-    request.nodesToReadSize = varsCount;
+    ctx->freeItemContexts = freeItemContexts;
+    ctx->itemContextsCapacity = capacity;
+    return 1;
+}
 
-    UA_ReadResponse response = UA_Client_Service_read(client, request);
-    UA_StatusCode retval = response.responseHeader.serviceResult;
-    if(retval == UA_STATUSCODE_GOOD) {
-        if(response.resultsSize == varsCount)
-            retval = response.results[0].status;
-        else
-            retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
+static void *newItemContext(struct OpcuaClientContext *ctx, VALUE v_context) {
+    if (NIL_P(v_context)) {
+        return NULL;
     }
 
-    if(retval != UA_STATUSCODE_GOOD) {
-        UA_ReadResponse_deleteMembers(&response);
-        UA_free(rValues);
-        return retval;
+    /* freeItemContext runs in callbacks of calls without the GVL */
+    rb_nativethread_lock_lock(&ctx->itemContextsLock);
+
+    if (ctx->freeItemContextsCount == 0 && ctx->itemContextsSize == ctx->itemContextsCapacity &&
+        !growItemContexts(ctx)) {
+        rb_nativethread_lock_unlock(&ctx->itemContextsLock);
+        rb_memerror();
     }
 
-    /* Set the StatusCode */
-    UA_DataValue *results = response.results;
+    size_t slot = ctx->freeItemContextsCount > 0 ?
+        ctx->freeItemContexts[--ctx->freeItemContextsCount] : ctx->itemContextsSize++;
+    ctx->itemContexts[slot] = v_context;
 
-    if (response.resultsSize != varsCount) {
-        retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
-        UA_ReadResponse_deleteMembers(&response);
-        UA_free(rValues);
-        return retval;
-    }
+    rb_nativethread_lock_unlock(&ctx->itemContextsLock);
+    return (void *)(uintptr_t)(slot + 1);
+}
 
-    for (int i=0; i<varsCount; i++) {
-        if ((results[i].hasStatus && results[i].status != UA_STATUSCODE_GOOD) || !results[i].hasValue) {
-            retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
-            UA_ReadResponse_deleteMembers(&response);
-            UA_free(rValues);
-            return retval;
-        }
-    }
+static VALUE itemContext(const struct OpcuaClientContext *ctx, void *monContext) {
+    return monContext ? ctx->itemContexts[(uintptr_t)monContext - 1] : Qnil;
+}
 
-    for (int i=0; i<varsCount; i++) {
-        out[i] = results[i].value;
-        UA_Variant_init(&results[i].value);
-    }
+static void freeItemContext(struct OpcuaClientContext *ctx, void *monContext) {
+    if (monContext) {
+        size_t slot = (uintptr_t)monContext - 1;
 
-    UA_ReadResponse_deleteMembers(&response);
-    UA_free(rValues);
-    return retval;
+        rb_nativethread_lock_lock(&ctx->itemContextsLock);
+        ctx->itemContexts[slot] = Qnil;
+        ctx->freeItemContexts[ctx->freeItemContextsCount++] = slot;
+        rb_nativethread_lock_unlock(&ctx->itemContextsLock);
+    }
 }
 
-static UA_StatusCode multiWrite(UA_Client *client, const UA_NodeId *nodeId, const UA_Variant *in, const long varsSize) {
-    UA_AttributeId attributeId = UA_ATTRIBUTEID_VALUE;
+/* A UA_Client call running without the GVL */
+struct BlockingCall {
+    struct OpcuaClientContext *ctx;
+    void *(*func)(void *);
+    void *data;
+    int started;
+    int closeOnInterrupt;
+    volatile int interrupted;
+};
 
-    UA_UInt16 wvSize = UA_TYPES[UA_TYPES_WRITEVALUE].memSize;
+static OPCUA_THREAD_LOCAL struct BlockingCall *currentBlockingCall;
 
-    UA_WriteValue *wValues = UA_calloc(varsSize, wvSize);
+static UA_StatusCode (*tcpRecv)(UA_Connection *connection, UA_ByteString *response, UA_UInt32 timeout);
 
-    for (int i=0; i<varsSize; i++) {
-        UA_WriteValue *wValue = &wValues[i];
-        wValue->attributeId = attributeId;
-        wValue->nodeId = nodeId[i];
-        wValue->value.value = in[i];
-        wValue->value.hasValue = true;
-    }
+/* Runs the interrupts that woke up a call without the GVL. Returns ctx if
+ * this deferred an exception, NULL for a wakeup that raised none (such as a
+ * signal trap). */
+static void *deferInterruptsWithGvl(void *ptr) {
+    struct OpcuaClientContext *ctx = ptr;
+    int previousGvlReleased = ctx->gvlReleased;
 
-    UA_WriteRequest wReq;
-    UA_WriteRequest_init(&wReq);
-    wReq.nodesToWrite = wValues;
-    wReq.nodesToWriteSize = varsSize;
+    ctx->gvlReleased = 0;
+    int deferred = !deferInterrupts();
+    ctx->gvlReleased = previousGvlReleased;
 
-    UA_WriteResponse wResp = UA_Client_Service_write(client, wReq);
+    return deferred ? ctx : NULL;
+}
 
-    UA_StatusCode retval = wResp.responseHeader.serviceResult;
-    if(retval == UA_STATUSCODE_GOOD) {
-        if(wResp.resultsSize == varsSize) {
-            retval = wResp.results[0];
+/* Receives like the TCP network layer, but waits in short slices so that an
+ * interrupted call gives up once the interrupt raised. The pending response
+ * could not be matched to a later request anymore, so the connection is
+ * closed. */
+static UA_StatusCode
+interruptibleRecv(UA_Connection *connection, UA_ByteString *response, UA_UInt32 timeout) {
+    struct BlockingCall *call = currentBlockingCall;
 
-            for (int i=0; i<wResp.resultsSize; i++) {
-                if (wResp.results[i] != UA_STATUSCODE_GOOD) {
-                    retval = wResp.results[i];
-                    // printf("%s\n", "multiWrite: bad result found");
-                    break;
-                }
+    if (!call || timeout == 0) {
+        return tcpRecv(connection, response, timeout);
+    }
+
+    for (;;) {
+        if (call->interrupted && call->closeOnInterrupt) {
+            if (rb_thread_call_with_gvl(deferInterruptsWithGvl, call->ctx)) {
+                break;
+            }
+
+            call->interrupted = 0;
+        }
+
+        UA_UInt32 slice = timeout < INTERRUPT_CHECK_INTERVAL_MS ? timeout : INTERRUPT_CHECK_INTERVAL_MS;
+        UA_StatusCode status = tcpRecv(connection, response, slice);
+
+        if (status != UA_STATUSCODE_GOODNONCRITICALTIMEOUT || timeout == slice) {
+            return status;
+        }
+
+        timeout -= slice;
+    }
+
+    connection->close(connection);
+    return UA_STATUSCODE_BADCONNECTIONCLOSED;
+}
+
+static UA_Connection
+interruptibleConnectionTCP(UA_ConnectionConfig conf, const char *endpointUrl,
+                           const UA_UInt32 timeout, UA_Logger logger) {
+    UA_Connection connection = UA_ClientConnectionTCP(conf, endpointUrl, timeout, logger);
+    tcpRecv = connection.recv;
+    connection.recv = interruptibleRecv;
+    return connection;
+}
+
+static void *blockingCallTrampoline(void *ptr) {
+    struct BlockingCall *call = ptr;
+    struct BlockingCall *previousCall = currentBlockingCall;
+    int previousGvlReleased = call->ctx->gvlReleased;
+
+    call->started = 1;
+    currentBlockingCall = call;
+    call->ctx->gvlReleased = 1;
+
+    void *result = call->func(call->data);
+
+    call->ctx->gvlReleased = previousGvlReleased;
+    currentBlockingCall = previousCall;
+    return result;
+}
+
+static void unblockBlockingCall(void *ptr) {
+    struct BlockingCall *call = ptr;
+    call->interrupted = 1;
+}
+
+/* Returns NULL without running func if an exception is deferred */
+static void *runWithoutGvl(struct OpcuaClientContext *ctx, void *(*func)(void *), void *data, int closeOnInterrupt) {
+    struct BlockingCall call = { ctx, func, data, 0, closeOnInterrupt, 0 };
+    void *result = NULL;
+
+    if (!tryLockClient(ctx)) {
+        return NULL;
+    }
+
+    while (!call.started) {
+        result = rb_thread_call_without_gvl2(blockingCallTrampoline, &call, unblockBlockingCall, &call);
+
+        if (!call.started) {
+            unlockClient(ctx);
+
+            if (!deferInterrupts() || !tryLockClient(ctx)) {
+                return NULL;
+            }
+        }
+    }
+
+    unlockClient(ctx);
+    return result;
+}
+
+/* Runs func without the GVL. Exceptions of interrupts and callbacks are not
+ * raised here, also not while waiting for the client, so that the caller can
+ * free native memory first and then call raisePendingInterrupts. */
+static void *callWithoutGvl(struct OpcuaClientContext *ctx, void *(*func)(void *), void *data) {
+    return runWithoutGvl(ctx, func, data, 1);
+}
+
+/* Like callWithoutGvl, for calls that only wait for incoming messages. An
+ * interrupt ends the wait but keeps the connection open. */
+static void *waitWithoutGvl(struct OpcuaClientContext *ctx, void *(*func)(void *), void *data) {
+    return runWithoutGvl(ctx, func, data, 0);
+}
+
+static int blockingCallInterrupted(void) {
+    return currentBlockingCall && currentBlockingCall->interrupted;
+}
+
+/* Raises the exception of a callback that failed while the GVL was released,
+ * or of an interrupt such as Thread#raise, deferred or pending */
+static void raisePendingInterrupts(struct OpcuaClientContext *ctx) {
+    int state = deferredInterrupt ? deferredInterrupt : ctx->callbackState;
+
+    if (state) {
+        deferredInterrupt = 0;
+        ctx->callbackState = 0;
+        rb_jump_tag(state);
+    }
+
+    rb_thread_check_ints();
+}
+
+struct RubyCallback {
+    struct OpcuaClientContext *ctx;
+    VALUE (*func)(VALUE);
+    VALUE arg;
+};
+
+static void *protectedCallbackWithGvl(void *ptr) {
+    struct RubyCallback *cb = ptr;
+    int previousGvlReleased = cb->ctx->gvlReleased;
+    int state = 0;
+
+    cb->ctx->gvlReleased = 0;
+    rb_protect(cb->func, cb->arg, &state);
+    cb->ctx->gvlReleased = previousGvlReleased;
+
+    if (state) {
+        cb->ctx->callbackState = state;
+    }
+
+    return NULL;
+}
+
+/* Calls into Ruby from an open62541 callback. When the client runs without the
+ * GVL, it is reacquired and an exception is kept until the call returns. */
+static void runRubyCallback(struct OpcuaClientContext *ctx, VALUE (*func)(VALUE), void *data) {
+    if (!ctx->gvlReleased) {
+        func((VALUE)data);
+        return;
+    }
+
+    if (ctx->callbackState) {
+        return;
+    }
+
+    struct RubyCallback cb = { ctx, func, (VALUE)data };
+    rb_thread_call_with_gvl(protectedCallbackWithGvl, &cb);
+}
+
+/* A UTC Time with the full 100 ns precision of raw_date */
+static VALUE toRubyTime(UA_DateTime raw_date) {
+    UA_DateTime sinceEpoch = raw_date - UA_DATETIME_UNIX_EPOCH;
+    UA_DateTime sec = sinceEpoch / UA_DATETIME_SEC;
+    UA_DateTime rest = sinceEpoch % UA_DATETIME_SEC;
+
+    if (rest < 0) {
+        sec--;
+        rest += UA_DATETIME_SEC;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)sec;
+    ts.tv_nsec = (long)(rest * 100);
+    return rb_time_timespec_new(&ts, INT_MAX - 1);
+}
+
+/* The DateTimes whose nanoseconds since the Unix epoch fit into an Int64 */
+#define EPOCH_NS_MIN_DATETIME (UA_DATETIME_UNIX_EPOCH + INT64_MIN / 100)
+#define EPOCH_NS_MAX_DATETIME (UA_DATETIME_UNIX_EPOCH + INT64_MAX / 100)
+
+/* Sets ns to the nanoseconds since the Unix epoch of raw_date, clamped to the
+ * Int64 range. Returns 0 if the value had to be clamped. */
+static int toEpochNs(UA_DateTime raw_date, int64_t *ns) {
+    if (raw_date < EPOCH_NS_MIN_DATETIME) {
+        *ns = INT64_MIN;
+        return 0;
+    }
+
+    if (raw_date > EPOCH_NS_MAX_DATETIME) {
+        *ns = INT64_MAX;
+        return 0;
+    }
+
+    *ns = (raw_date - UA_DATETIME_UNIX_EPOCH) * 100;
+    return 1;
+}
+
+/* A server or source timestamp, as Time or as Integer nanoseconds since the
+ * Unix epoch depending on timestamp_format */
+static VALUE toRubyTimestamp(const struct OpcuaClientContext *ctx, UA_DateTime raw_date) {
+    if (ctx->epochNsTimestamps) {
+        int64_t ns;
+        if (toEpochNs(raw_date, &ns)) {
+            return LL2NUM(ns);
+        }
+
+        /* Far from the epoch, like the DateTime maximum some servers send */
+        VALUE v_sinceEpoch = rb_funcall(LL2NUM(raw_date), '-', 1, LL2NUM(UA_DATETIME_UNIX_EPOCH));
+        return rb_funcall(v_sinceEpoch, '*', 1, INT2FIX(100));
+    }
+
+    return toRubyTime(raw_date);
+}
+
+static VALUE toRubyValue(const UA_Variant *value);
+
+struct DataChange {
+    struct OpcuaClientContext *ctx;
+    UA_UInt32 subId;
+    UA_UInt32 monId;
+    void *monContext;
+    UA_DataValue *value;
+};
+
+static VALUE dataChangedWithGvl(VALUE ptr) {
+    struct DataChange *change = (struct DataChange *)ptr;
+    UA_UInt32 subId = change->subId;
+    UA_UInt32 monId = change->monId;
+    UA_DataValue *value = change->value;
+
+    VALUE self = change->ctx->rubyClientInstance;
+    VALUE callback = rb_ivar_get(self, rb_intern("@callback_after_data_changed"));
+
+    if (NIL_P(callback)) {
+        return Qnil;
+    }
+
+    VALUE v_serverTime = Qnil;
+    if (value->hasServerTimestamp) {
+        v_serverTime = toRubyTimestamp(change->ctx, value->serverTimestamp);
+    }
+
+    VALUE v_sourceTime = Qnil;
+    if (value->hasSourceTimestamp) {
+        v_sourceTime = toRubyTimestamp(change->ctx, value->sourceTimestamp);
+    }
+
+    VALUE params = rb_ary_new();
+    rb_ary_push(params, UINT2NUM(subId));
+    rb_ary_push(params, UINT2NUM(monId));
+    rb_ary_push(params, v_serverTime);
+    rb_ary_push(params, v_sourceTime);
+
+    VALUE v_newValue = toRubyValue(&value->value);
+
+    rb_ary_push(params, v_newValue);
+
+    /* Lambdas taking the five parameters from before contexts still work */
+    int arity = rb_proc_arity(callback);
+    if (arity < 0 || arity >= 6) {
+        rb_ary_push(params, itemContext(change->ctx, change->monContext));
+    }
+
+    return rb_proc_call(callback, params);
+}
+
+static void freeQueuedChange(struct QueuedChange *change) {
+    if (!change->inlineType) {
+        UA_Variant_deleteMembers(&change->variant);
+    }
+}
+
+/* Appends to the change queue, overwriting the oldest entry when it is full.
+ * The value is taken out of the response like in batchDataChange. */
+static void queueDataChange(struct OpcuaClientContext *ctx, UA_UInt32 monId, UA_DataValue *value) {
+    rb_nativethread_lock_lock(&ctx->changeQueueLock);
+
+    if (ctx->changeQueue) {
+        struct QueuedChange *change;
+
+        if (ctx->changeQueueSize == ctx->changeQueueCapacity) {
+            change = &ctx->changeQueue[ctx->changeQueueHead];
+            freeQueuedChange(change);
+            ctx->changeQueueHead = (ctx->changeQueueHead + 1) % ctx->changeQueueCapacity;
+            ctx->droppedChanges++;
+        } else {
+            change = &ctx->changeQueue[(ctx->changeQueueHead + ctx->changeQueueSize++) % ctx->changeQueueCapacity];
+        }
+
+        change->monId = monId;
+        change->status = value->hasStatus ? value->status : UA_STATUSCODE_GOOD;
+        change->serverTime = value->hasServerTimestamp ? value->serverTimestamp : 0;
+        change->sourceTime = value->hasSourceTimestamp ? value->sourceTimestamp : 0;
+
+        const UA_Variant *variant = &value->value;
+        if (variant->type && UA_Variant_isScalar(variant) && variant->type->pointerFree &&
+            variant->type->memSize <= sizeof(change->inlineValue)) {
+            change->inlineType = variant->type;
+            memcpy(change->inlineValue.bytes, variant->data, variant->type->memSize);
+        } else {
+            change->inlineType = NULL;
+            change->variant = value->value;
+            UA_Variant_init(&value->value);
+        }
+    }
+
+    rb_nativethread_lock_unlock(&ctx->changeQueueLock);
+}
+
+struct DataChangeBatch {
+    struct OpcuaClientContext *ctx;
+    UA_UInt32 subId;
+    const struct BatchedDataChange *changes;
+    size_t size;
+};
+
+static VALUE dataChangeBatchWithGvl(VALUE ptr) {
+    struct DataChangeBatch *batch = (struct DataChangeBatch *)ptr;
+    struct OpcuaClientContext *ctx = batch->ctx;
+
+    VALUE self = ctx->rubyClientInstance;
+    VALUE callback = rb_ivar_get(self, rb_intern("@callback_after_data_changed_batch"));
+
+    if (NIL_P(callback)) {
+        return Qnil;
+    }
+
+    long size = batch->size;
+    VALUE v_monIds = rb_ary_new_capa(size);
+    VALUE v_serverTimes = rb_ary_new_capa(size);
+    VALUE v_sourceTimes = rb_ary_new_capa(size);
+    VALUE v_values = rb_ary_new_capa(size);
+    VALUE v_statuses = rb_ary_new_capa(size);
+    VALUE v_contexts = rb_ary_new_capa(size);
+
+    for (long i=0; i<size; i++) {
+        const UA_DataValue *value = &batch->changes[i].value;
+
+        rb_ary_push(v_monIds, UINT2NUM(batch->changes[i].monId));
+        rb_ary_push(v_serverTimes, value->hasServerTimestamp ? toRubyTimestamp(ctx, value->serverTimestamp) : Qnil);
+        rb_ary_push(v_sourceTimes, value->hasSourceTimestamp ? toRubyTimestamp(ctx, value->sourceTimestamp) : Qnil);
+        rb_ary_push(v_values, toRubyValue(&value->value));
+        rb_ary_push(v_statuses, UINT2NUM(value->hasStatus ? value->status : UA_STATUSCODE_GOOD));
+        rb_ary_push(v_contexts, itemContext(ctx, batch->changes[i].monContext));
+    }
+
+    VALUE params = rb_ary_new_from_args(7, UINT2NUM(batch->subId), v_monIds, v_serverTimes,
+                                        v_sourceTimes, v_values, v_statuses, v_contexts);
+    return rb_proc_call(callback, params);
+}
+
+static void clearDataChangeBatch(struct OpcuaClientContext *ctx) {
+    for (size_t i=0; i<ctx->batchSize; i++) {
+        UA_DataValue_deleteMembers(&ctx->batch[i].value);
+    }
+
+    ctx->batchSize = 0;
+}
+
+static void deliverDataChanges(struct OpcuaClientContext *ctx, UA_UInt32 subId,
+                               const struct BatchedDataChange *changes, size_t size) {
+    if (size > 0 && !ctx->deleting) {
+        struct DataChangeBatch batch = { ctx, subId, changes, size };
+        runRubyCallback(ctx, dataChangeBatchWithGvl, &batch);
+    }
+}
+
+/* Delivers the notifications of one PublishResponse with one call */
+static void
+notificationsProcessedCallback(UA_Client *client, UA_UInt32 subId, void *subContext) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    deliverDataChanges(ctx, subId, ctx->batch, ctx->batchSize);
+    clearDataChangeBatch(ctx);
+}
+
+/* Takes the value out of the response, which is freed after processing. If
+ * the batch cannot grow, the changes batched so far are delivered early, so
+ * that a PublishResponse may then take more than one call. */
+static void batchDataChange(struct OpcuaClientContext *ctx, UA_UInt32 subId, UA_UInt32 monId,
+                            void *monContext, UA_DataValue *value) {
+    if (ctx->batchSize == ctx->batchCapacity) {
+        size_t capacity = ctx->batchCapacity ? ctx->batchCapacity * 2 : 64;
+        struct BatchedDataChange *batch = UA_realloc(ctx->batch, capacity * sizeof(struct BatchedDataChange));
+
+        if (batch) {
+            ctx->batch = batch;
+            ctx->batchCapacity = capacity;
+        } else if (ctx->batchCapacity > 0) {
+            deliverDataChanges(ctx, subId, ctx->batch, ctx->batchSize);
+            clearDataChangeBatch(ctx);
+        } else {
+            struct BatchedDataChange change = { monId, monContext, *value };
+            deliverDataChanges(ctx, subId, &change, 1);
+            return;
+        }
+    }
+
+    struct BatchedDataChange *change = &ctx->batch[ctx->batchSize++];
+    change->monId = monId;
+    change->monContext = monContext;
+    change->value = *value;
+    UA_DataValue_init(value);
+}
+
+static void
+handler_dataChanged(UA_Client *client, UA_UInt32 subId, void *subContext,
+                           UA_UInt32 monId, void *monContext, UA_DataValue *value) {
+
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    ctx->dataChanges++;
+
+    if (ctx->changeQueue) {
+        queueDataChange(ctx, monId, value);
+        return;
+    }
+
+    if (ctx->batchDataChanges) {
+        batchDataChange(ctx, subId, monId, monContext, value);
+        return;
+    }
+
+    struct DataChange change = { ctx, subId, monId, monContext, value };
+    runRubyCallback(ctx, dataChangedWithGvl, &change);
+}
+
+/* Items that could not be created come with monId 0, the add frees their
+ * contexts itself as it also has those of items never sent */
+static void
+monitoredItemDeleted(UA_Client *client, UA_UInt32 subId, void *subContext,
+                     UA_UInt32 monId, void *monContext) {
+    if (monId != 0) {
+        freeItemContext(UA_Client_getContext(client), monContext);
+    }
+}
+
+static void
+deleteSubscriptionCallback(UA_Client *client, UA_UInt32 subscriptionId, void *subscriptionContext) {
+    // printf("Subscription Id %u was deleted\n", subscriptionId);
+}
+
+static void
+subscriptionInactivityCallback(UA_Client *client, UA_UInt32 subscriptionId, void *subContext) {
+    // printf("Inactivity for subscription %u", subscriptionId);
+}
+
+static VALUE sessionCreatedWithGvl(VALUE ptr) {
+    struct OpcuaClientContext *ctx = (struct OpcuaClientContext *)ptr;
+    VALUE self = ctx->rubyClientInstance;
+
+    VALUE callback = rb_ivar_get(self, rb_intern("@callback_after_session_created"));
+    if (!NIL_P(callback)) {
+        VALUE params = rb_ary_new();
+        rb_ary_push(params, self);
+        rb_proc_call(callback, params);
+    }
+
+    return Qnil;
+}
+
+static void
+stateCallback (UA_Client *client, UA_ClientState clientState) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    switch(clientState) {
+        case UA_CLIENTSTATE_DISCONNECTED:
+            ; // printf("%s\n", "The client is disconnected");
+            break;
+        case UA_CLIENTSTATE_CONNECTED:
+            ; // printf("%s\n", "A TCP connection to the server is open");
+            break;
+        case UA_CLIENTSTATE_SECURECHANNEL:
+            ; // printf("%s\n", "A SecureChannel to the server is open");
+            break;
+        case UA_CLIENTSTATE_SESSION:
+            ; // printf("%s\n", "A new session was created!");
+            ctx->sessionCount++;
+            ctx->operationLimitsRead = 0;
+            /* The server may have restarted with other values */
+            nodeMapClear(&ctx->writeShadow, freeShadowValue);
+            runRubyCallback(ctx, sessionCreatedWithGvl, ctx);
+            break;
+        case UA_CLIENTSTATE_SESSION_RENEWED:
+            /* The session was renewed. We don't need to recreate the subscription. */
+            break;
+    }
+    return;
+}
+
+static VALUE raise_invalid_arguments_error() {
+    rb_raise(cError, "Invalid arguments");
+    return Qnil;
+}
+
+static VALUE raise_ua_status_error(UA_StatusCode status) {
+    rb_raise(cError, "%u: %s", status, UA_StatusCode_name(status));
+    return Qnil;
+}
+
+static void UA_Client_free(void *self) {
+    // printf("free client\n");
+    struct UninitializedClient *uclient = self;
+
+    if (uclient->client) {
+        struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+        ctx->deleting = 1;
+        UA_Client_delete(uclient->client);
+        nodeMapClear(&ctx->nodeTypes, NULL);
+        nodeMapClear(&ctx->writeShadow, freeShadowValue);
+        clearDataChangeBatch(ctx);
+        UA_free(ctx->batch);
+        UA_free(ctx->itemContexts);
+        UA_free(ctx->freeItemContexts);
+        for (size_t i=0; i<ctx->changeQueueSize; i++) {
+            freeQueuedChange(&ctx->changeQueue[(ctx->changeQueueHead + i) % ctx->changeQueueCapacity]);
+        }
+        UA_free(ctx->changeQueue);
+        rb_nativethread_lock_destroy(&ctx->changeQueueLock);
+        rb_nativethread_lock_destroy(&ctx->itemContextsLock);
+        xfree(ctx);
+    }
+
+    xfree(self);
+}
+
+static void UA_Client_mark(void *self) {
+    struct UninitializedClient *uclient = self;
+
+    if (uclient->client) {
+        struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+        rb_gc_mark(ctx->lockOwner);
+        rb_gc_mark(ctx->lockWaiters);
+
+        for (size_t i=0; i<ctx->itemContextsSize; i++) {
+            rb_gc_mark(ctx->itemContexts[i]);
+        }
+    }
+}
+
+static const rb_data_type_t UA_Client_Type = {
+    "UA_Uninitialized_Client",
+    { UA_Client_mark, UA_Client_free, 0 },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE allocate(VALUE klass) {
+    // printf("allocate client\n");
+    struct UninitializedClient *uclient = ALLOC(struct UninitializedClient);
+    *uclient = (const struct UninitializedClient){ 0 };
+
+    return TypedData_Wrap_Struct(klass, &UA_Client_Type, uclient);
+}
+
+static VALUE rb_initialize(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+
+    UA_ClientConfig customConfig = UA_ClientConfig_default;
+    customConfig.stateCallback = stateCallback;
+    customConfig.connectionFunc = interruptibleConnectionTCP;
+    customConfig.subscriptionInactivityCallback = subscriptionInactivityCallback;
+    customConfig.notificationsProcessedCallback = notificationsProcessedCallback;
+
+    struct OpcuaClientContext *ctx = ALLOC(struct OpcuaClientContext);
+    *ctx = (const struct OpcuaClientContext){ 0 };
+    ctx->nodeTypes.valueSize = sizeof(struct NodeType);
+    ctx->writeShadow.valueSize = sizeof(UA_Variant);
+    rb_nativethread_lock_initialize(&ctx->changeQueueLock);
+    rb_nativethread_lock_initialize(&ctx->itemContextsLock);
+    ctx->lockOwner = Qnil;
+    ctx->lockWaiters = rb_ary_new();
+
+    ctx->rubyClientInstance = self;
+    ctx->requestTimeout = customConfig.timeout;
+    customConfig.clientContext = ctx;
+
+    uclient->client = UA_Client_new(customConfig);
+
+    return Qnil;
+}
+
+struct ConnectCall {
+    UA_Client *client;
+    const char *connectionString;
+    UA_StatusCode status;
+};
+
+static void *connectWithoutGvl(void *ptr) {
+    struct ConnectCall *call = ptr;
+    call->status = UA_Client_connect(call->client, call->connectionString);
+    return NULL;
+}
+
+static VALUE rb_connect(VALUE self, VALUE v_connectionString) {
+    if (RB_TYPE_P(v_connectionString, T_STRING) != 1) {
+        return raise_invalid_arguments_error();
+    }
+
+    StringValueCStr(v_connectionString);
+    VALUE v_frozenConnectionString = rb_str_new_frozen(v_connectionString);
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    struct ConnectCall call = { client, RSTRING_PTR(v_frozenConnectionString), 0 };
+    callWithoutGvl(ctx, connectWithoutGvl, &call);
+    RB_GC_GUARD(v_frozenConnectionString);
+    raisePendingInterrupts(ctx);
+
+    UA_StatusCode status = call.status;
+
+    if (status == UA_STATUSCODE_GOOD) {
+        return Qnil;
+    } else {
+        return raise_ua_status_error(status);
+    }
+}
+
+/* Builds string NodeIds for an Array of names in a single allocation. The
+ * identifiers are copied, so they stay valid while the GVL is released. */
+static UA_NodeId *newStringNodeIds(UA_UInt16 nsIndex, VALUE v_aryNames) {
+    const long namesCount = RARRAY_LEN(v_aryNames);
+    size_t namesLength = 0;
+
+    for (int i=0; i<namesCount; i++) {
+        VALUE v_name = rb_ary_entry(v_aryNames, i);
+
+        if (RB_TYPE_P(v_name, T_STRING) != 1) {
+            raise_invalid_arguments_error();
+        }
+
+        namesLength += RSTRING_LEN(v_name);
+    }
+
+    UA_NodeId *nodes = UA_malloc(namesCount * sizeof(UA_NodeId) + namesLength);
+    UA_Byte *names = (UA_Byte *)&nodes[namesCount];
+
+    for (int i=0; i<namesCount; i++) {
+        VALUE v_name = rb_ary_entry(v_aryNames, i);
+        long nameLength = RSTRING_LEN(v_name);
+
+        memcpy(names, RSTRING_PTR(v_name), nameLength);
+        nodes[i].namespaceIndex = nsIndex;
+        nodes[i].identifierType = UA_NODEIDTYPE_STRING;
+        nodes[i].identifier.string.length = nameLength;
+        nodes[i].identifier.string.data = names;
+        names += nameLength;
+    }
+
+    return nodes;
+}
+
+/* OPCUAClient::NodeId wraps one UA_NodeId */
+static void NodeId_free(void *ptr) {
+    UA_NodeId *nodeId = ptr;
+    UA_NodeId_deleteMembers(nodeId);
+    xfree(nodeId);
+}
+
+static size_t NodeId_memsize(const void *ptr) {
+    const UA_NodeId *nodeId = ptr;
+    size_t size = sizeof(UA_NodeId);
+    if (nodeId->identifierType == UA_NODEIDTYPE_STRING || nodeId->identifierType == UA_NODEIDTYPE_BYTESTRING) {
+        size += nodeId->identifier.string.length;
+    }
+    return size;
+}
+
+static const rb_data_type_t NodeId_Type = {
+    "OPCUAClient::NodeId",
+    { 0, NodeId_free, NodeId_memsize },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE allocateNodeId(VALUE klass) {
+    UA_NodeId *nodeId = ALLOC(UA_NodeId);
+    UA_NodeId_init(nodeId);
+
+    return TypedData_Wrap_Struct(klass, &NodeId_Type, nodeId);
+}
+
+static VALUE newRubyNodeId(const UA_NodeId *src) {
+    VALUE v_node = allocateNodeId(cNodeId);
+    UA_NodeId *nodeId = DATA_PTR(v_node);
+
+    UA_StatusCode status = UA_NodeId_copy(src, nodeId);
+    if (status != UA_STATUSCODE_GOOD) {
+        raise_ua_status_error(status);
+    }
+
+    return rb_obj_freeze(v_node);
+}
+
+static const UA_NodeId *rubyNodeId(VALUE v_node) {
+    UA_NodeId *nodeId;
+    TypedData_Get_Struct(v_node, UA_NodeId, &NodeId_Type, nodeId);
+    return nodeId;
+}
+
+static void copyRubyString(VALUE v_str, UA_String *out) {
+    long length = RSTRING_LEN(v_str);
+    *out = UA_STRING_NULL;
+
+    if (length > 0) {
+        out->data = UA_malloc(length);
+        if (!out->data) {
+            rb_memerror();
+        }
+        memcpy(out->data, RSTRING_PTR(v_str), length);
+        out->length = length;
+    }
+}
+
+/* Parses "72962B91-FA75-4AE6-8D28-B404DC7DAF63" */
+static int parseGuid(VALUE v_str, UA_Guid *guid) {
+    if (RSTRING_LEN(v_str) != 36) {
+        return 0;
+    }
+
+    const char *str = RSTRING_PTR(v_str);
+    unsigned int parts[11];
+    char rest;
+    int n = sscanf(str, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%c",
+                   &parts[0], &parts[1], &parts[2], &parts[3], &parts[4], &parts[5],
+                   &parts[6], &parts[7], &parts[8], &parts[9], &parts[10], &rest);
+
+    if (n != 11 || str[8] != '-' || str[13] != '-' || str[18] != '-' || str[23] != '-') {
+        return 0;
+    }
+
+    for (int i=0; i<36; i++) {
+        if (i != 8 && i != 13 && i != 18 && i != 23 && !ISXDIGIT(str[i])) {
+            return 0;
+        }
+    }
+
+    guid->data1 = parts[0];
+    guid->data2 = parts[1];
+    guid->data3 = parts[2];
+    for (int i=0; i<8; i++) {
+        guid->data4[i] = parts[3 + i];
+    }
+
+    return 1;
+}
+
+/* NodeId.new(ns, identifier, type = nil). The type is :numeric, :string,
+ * :guid or :bytestring, by default :numeric for an Integer identifier and
+ * :string otherwise. */
+static VALUE rb_initializeNodeId(int argc, VALUE *argv, VALUE self) {
+    VALUE v_nsIndex, v_identifier, v_type;
+    rb_scan_args(argc, argv, "21", &v_nsIndex, &v_identifier, &v_type);
+
+    rb_check_frozen(self);
+
+    UA_NodeId *nodeId;
+    TypedData_Get_Struct(self, UA_NodeId, &NodeId_Type, nodeId);
+
+    UA_UInt16 nsIndex = NUM2USHORT(v_nsIndex);
+    ID type;
+
+    if (NIL_P(v_type)) {
+        type = RB_INTEGER_TYPE_P(v_identifier) ? rb_intern("numeric") : rb_intern("string");
+    } else {
+        type = rb_sym2id(v_type);
+    }
+
+    UA_NodeId_deleteMembers(nodeId);
+    nodeId->namespaceIndex = nsIndex;
+
+    if (type == rb_intern("numeric")) {
+        nodeId->identifierType = UA_NODEIDTYPE_NUMERIC;
+        nodeId->identifier.numeric = NUM2UINT(v_identifier);
+    } else if (type == rb_intern("string")) {
+        StringValue(v_identifier);
+        nodeId->identifierType = UA_NODEIDTYPE_STRING;
+        copyRubyString(v_identifier, &nodeId->identifier.string);
+    } else if (type == rb_intern("guid")) {
+        StringValue(v_identifier);
+        nodeId->identifierType = UA_NODEIDTYPE_GUID;
+        if (!parseGuid(v_identifier, &nodeId->identifier.guid)) {
+            rb_raise(cError, "Invalid GUID: %"PRIsVALUE, v_identifier);
+        }
+    } else if (type == rb_intern("bytestring")) {
+        StringValue(v_identifier);
+        nodeId->identifierType = UA_NODEIDTYPE_BYTESTRING;
+        copyRubyString(v_identifier, &nodeId->identifier.byteString);
+    } else {
+        rb_raise(cError, "Unsupported NodeId type");
+    }
+
+    rb_obj_freeze(self);
+    return self;
+}
+
+static VALUE rb_nodeIdNamespaceIndex(VALUE self) {
+    return INT2FIX(rubyNodeId(self)->namespaceIndex);
+}
+
+static VALUE rb_nodeIdIdentifierType(VALUE self) {
+    switch (rubyNodeId(self)->identifierType) {
+        case UA_NODEIDTYPE_NUMERIC:
+            return ID2SYM(rb_intern("numeric"));
+        case UA_NODEIDTYPE_STRING:
+            return ID2SYM(rb_intern("string"));
+        case UA_NODEIDTYPE_GUID:
+            return ID2SYM(rb_intern("guid"));
+        default:
+            return ID2SYM(rb_intern("bytestring"));
+    }
+}
+
+static VALUE toRubyGuid(const UA_Guid *guid) {
+    return rb_sprintf("%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+                      guid->data1, guid->data2, guid->data3,
+                      guid->data4[0], guid->data4[1], guid->data4[2], guid->data4[3],
+                      guid->data4[4], guid->data4[5], guid->data4[6], guid->data4[7]);
+}
+
+/* Integer, String, GUID String or binary String, depending on the type */
+static VALUE rb_nodeIdIdentifier(VALUE self) {
+    const UA_NodeId *nodeId = rubyNodeId(self);
+
+    switch (nodeId->identifierType) {
+        case UA_NODEIDTYPE_NUMERIC:
+            return UINT2NUM(nodeId->identifier.numeric);
+        case UA_NODEIDTYPE_STRING:
+            return rb_utf8_str_new((const char *)nodeId->identifier.string.data, nodeId->identifier.string.length);
+        case UA_NODEIDTYPE_GUID:
+            return toRubyGuid(&nodeId->identifier.guid);
+        default:
+            return rb_str_new((const char *)nodeId->identifier.byteString.data, nodeId->identifier.byteString.length);
+    }
+}
+
+static VALUE rb_nodeIdEqual(VALUE self, VALUE other) {
+    if (!rb_typeddata_is_kind_of(other, &NodeId_Type)) {
+        return Qfalse;
+    }
+
+    return UA_NodeId_equal(rubyNodeId(self), rubyNodeId(other)) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_nodeIdHash(VALUE self) {
+    return UINT2NUM(UA_NodeId_hash(rubyNodeId(self)));
+}
+
+/* Copies the NodeIds of an Array of OPCUAClient::NodeId into a single
+ * allocation, like newStringNodeIds. */
+static UA_NodeId *newNodeIdsFromRuby(VALUE v_aryNodes) {
+    const long nodesCount = RARRAY_LEN(v_aryNodes);
+    size_t identifiersLength = 0;
+
+    for (int i=0; i<nodesCount; i++) {
+        const UA_NodeId *nodeId = rubyNodeId(rb_ary_entry(v_aryNodes, i));
+
+        if (nodeId->identifierType == UA_NODEIDTYPE_STRING || nodeId->identifierType == UA_NODEIDTYPE_BYTESTRING) {
+            identifiersLength += nodeId->identifier.string.length;
+        }
+    }
+
+    UA_NodeId *nodes = UA_malloc(nodesCount * sizeof(UA_NodeId) + identifiersLength);
+    UA_Byte *identifiers = (UA_Byte *)&nodes[nodesCount];
+
+    for (int i=0; i<nodesCount; i++) {
+        const UA_NodeId *nodeId = rubyNodeId(rb_ary_entry(v_aryNodes, i));
+        nodes[i] = *nodeId;
+
+        if (nodeId->identifierType == UA_NODEIDTYPE_STRING || nodeId->identifierType == UA_NODEIDTYPE_BYTESTRING) {
+            size_t length = nodeId->identifier.string.length;
+
+            if (length > 0) {
+                memcpy(identifiers, nodeId->identifier.string.data, length);
+                nodes[i].identifier.string.data = identifiers;
+                identifiers += length;
+            }
+        }
+    }
+
+    return nodes;
+}
+
+/* Node arguments come either as (ns, name) or as one OPCUAClient::NodeId.
+ * Returns how many of the arguments describe the node, without allocating. */
+static int nodeIdArgsCount(int argc, VALUE *argv) {
+    if (argc >= 1 && rb_typeddata_is_kind_of(argv[0], &NodeId_Type)) {
+        return 1;
+    }
+
+    if (argc < 2 || RB_TYPE_P(argv[0], T_FIXNUM) != 1 || RB_TYPE_P(argv[1], T_STRING) != 1) {
+        raise_invalid_arguments_error();
+    }
+
+    StringValueCStr(argv[1]);
+    return 2;
+}
+
+/* Copies the node described by nodeIdArgsCount arguments. The caller frees
+ * it with UA_NodeId_deleteMembers. */
+static UA_NodeId nodeIdFromArgs(int count, VALUE *argv) {
+    UA_NodeId nodeId;
+
+    if (count == 1) {
+        UA_NodeId_copy(rubyNodeId(argv[0]), &nodeId);
+    } else {
+        nodeId = UA_NODEID_STRING_ALLOC(FIX2INT(argv[0]), StringValueCStr(argv[1]));
+    }
+
+    return nodeId;
+}
+
+/* Like nodeIdArgsCount for (ns, names) or (Array[NodeId] nodes) */
+static int nodeIdsArgsCount(int argc, VALUE *argv, long *nodesCount) {
+    if (argc >= 1 && RB_TYPE_P(argv[0], T_ARRAY)) {
+        *nodesCount = RARRAY_LEN(argv[0]);
+        return 1;
+    }
+
+    if (argc < 2 || RB_TYPE_P(argv[0], T_FIXNUM) != 1) {
+        raise_invalid_arguments_error();
+    }
+
+    Check_Type(argv[1], T_ARRAY);
+    *nodesCount = RARRAY_LEN(argv[1]);
+    return 2;
+}
+
+/* Builds the nodes described by nodeIdsArgsCount arguments in a single
+ * allocation, which the caller frees with UA_free. */
+static UA_NodeId *nodeIdsFromArgs(int count, VALUE *argv) {
+    if (count == 1) {
+        return newNodeIdsFromRuby(argv[0]);
+    }
+
+    return newStringNodeIds(FIX2INT(argv[0]), argv[1]);
+}
+
+struct CreateSubscriptionCall {
+    UA_Client *client;
+    UA_CreateSubscriptionRequest request;
+    UA_CreateSubscriptionResponse response;
+};
+
+static void *createSubscriptionWithoutGvl(void *ptr) {
+    struct CreateSubscriptionCall *call = ptr;
+    call->response = UA_Client_Subscriptions_create(call->client, call->request, NULL, NULL, deleteSubscriptionCallback);
+    return NULL;
+}
+
+/* after_data_changed_batch { |sub_id, mon_ids, server_times, source_times, values, statuses, contexts| }
+ * Without a block, notifications go to after_data_changed again. */
+static VALUE rb_afterDataChangedBatch(VALUE self) {
+    VALUE v_callback = rb_block_given_p() ? rb_block_proc() : Qnil;
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    rb_ivar_set(self, rb_intern("@callback_after_data_changed_batch"), v_callback);
+    ctx->batchDataChanges = !NIL_P(v_callback);
+
+    return Qnil;
+}
+
+/* create_subscription(publishing_interval:, lifetime_count:, keep_alive_count:,
+ * max_notifications_per_publish:, priority:), each defaulting to the value
+ * of UA_CreateSubscriptionRequest_default */
+static VALUE rb_createSubscription(int argc, VALUE *argv, VALUE self) {
+    VALUE v_opts;
+    rb_scan_args(argc, argv, ":", &v_opts);
+
+    UA_CreateSubscriptionRequest request = UA_CreateSubscriptionRequest_default();
+
+    if (!NIL_P(v_opts)) {
+        ID kwargs[5] = {
+            rb_intern("publishing_interval"), rb_intern("lifetime_count"), rb_intern("keep_alive_count"),
+            rb_intern("max_notifications_per_publish"), rb_intern("priority"),
+        };
+        VALUE v_kwargs[5];
+        rb_get_kwargs(v_opts, kwargs, 0, 5, v_kwargs);
+
+        if (v_kwargs[0] != Qundef) {
+            request.requestedPublishingInterval = NUM2DBL(v_kwargs[0]);
+        }
+        if (v_kwargs[1] != Qundef) {
+            request.requestedLifetimeCount = NUM2UINT(v_kwargs[1]);
+        }
+        if (v_kwargs[2] != Qundef) {
+            request.requestedMaxKeepAliveCount = NUM2UINT(v_kwargs[2]);
+        }
+        if (v_kwargs[3] != Qundef) {
+            request.maxNotificationsPerPublish = NUM2UINT(v_kwargs[3]);
+        }
+        if (v_kwargs[4] != Qundef) {
+            int priority = NUM2INT(v_kwargs[4]);
+            if (priority < 0 || priority > UA_BYTE_MAX) {
+                return raise_invalid_arguments_error();
+            }
+            request.priority = (UA_Byte)priority;
+        }
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    struct CreateSubscriptionCall call = { client, request };
+    callWithoutGvl(ctx, createSubscriptionWithoutGvl, &call);
+    raisePendingInterrupts(ctx);
+
+    UA_CreateSubscriptionResponse response = call.response;
+
+    if (response.responseHeader.serviceResult == UA_STATUSCODE_GOOD) {
+        UA_UInt32 subscriptionId = response.subscriptionId;
+        return UINT2NUM(subscriptionId);
+    } else {
+        return Qnil;
+    }
+}
+
+/* Parameters of the monitored items created by one add_monitored_item(s)
+ * call. The filter points to dataChangeFilter and is shared by all items. */
+struct MonitoringOptions {
+    UA_Double samplingInterval;
+    UA_UInt32 queueSize;
+    UA_Boolean discardOldest;
+    int hasFilter;
+    UA_DataChangeFilter dataChangeFilter;
+};
+
+static int symbolIndex(VALUE v_symbol, const char *const *names, int namesSize) {
+    if (!SYMBOL_P(v_symbol)) {
+        return -1;
+    }
+
+    const char *name = rb_id2name(SYM2ID(v_symbol));
+    for (int i=0; i<namesSize; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* sampling_interval:, queue_size:, discard_oldest:, and a DataChangeFilter
+ * with trigger: (:status, :status_value, :status_value_timestamp),
+ * deadband: and deadband_type: (:absolute, :percent). The contextKey option
+ * is returned in v_context. */
+static void monitoringOptionsFromRuby(VALUE v_opts, struct MonitoringOptions *options,
+                                      const char *contextKey, VALUE *v_context) {
+    UA_MonitoredItemCreateRequest defaults = UA_MonitoredItemCreateRequest_default(UA_NODEID_NULL);
+    options->samplingInterval = defaults.requestedParameters.samplingInterval;
+    options->queueSize = defaults.requestedParameters.queueSize;
+    options->discardOldest = defaults.requestedParameters.discardOldest;
+    options->hasFilter = 0;
+    UA_DataChangeFilter_init(&options->dataChangeFilter);
+    options->dataChangeFilter.trigger = UA_DATACHANGETRIGGER_STATUSVALUE;
+    *v_context = Qnil;
+
+    if (NIL_P(v_opts)) {
+        return;
+    }
+
+    ID kwargs[7] = {
+        rb_intern("sampling_interval"), rb_intern("queue_size"), rb_intern("discard_oldest"),
+        rb_intern("trigger"), rb_intern("deadband"), rb_intern("deadband_type"), rb_intern(contextKey),
+    };
+    VALUE v_kwargs[7];
+    rb_get_kwargs(v_opts, kwargs, 0, 7, v_kwargs);
+
+    if (v_kwargs[6] != Qundef) {
+        *v_context = v_kwargs[6];
+    }
+
+    if (v_kwargs[0] != Qundef) {
+        options->samplingInterval = NUM2DBL(v_kwargs[0]);
+    }
+    if (v_kwargs[1] != Qundef) {
+        options->queueSize = NUM2UINT(v_kwargs[1]);
+    }
+    if (v_kwargs[2] != Qundef) {
+        options->discardOldest = RTEST(v_kwargs[2]);
+    }
+
+    if (v_kwargs[3] != Qundef) {
+        static const char *const triggers[] = { "status", "status_value", "status_value_timestamp" };
+        int trigger = symbolIndex(v_kwargs[3], triggers, 3);
+        if (trigger < 0) {
+            raise_invalid_arguments_error();
+        }
+        options->dataChangeFilter.trigger = (UA_DataChangeTrigger)trigger;
+        options->hasFilter = 1;
+    }
+
+    if (v_kwargs[4] != Qundef) {
+        options->dataChangeFilter.deadbandType = UA_DEADBANDTYPE_ABSOLUTE;
+        options->dataChangeFilter.deadbandValue = NUM2DBL(v_kwargs[4]);
+        options->hasFilter = 1;
+    }
+
+    if (v_kwargs[5] != Qundef) {
+        static const char *const deadbandTypes[] = { "none", "absolute", "percent" };
+        int deadbandType = symbolIndex(v_kwargs[5], deadbandTypes, 3);
+        if (deadbandType < 0) {
+            raise_invalid_arguments_error();
+        }
+        options->dataChangeFilter.deadbandType = (UA_UInt32)deadbandType;
+        options->hasFilter = 1;
+    }
+}
+
+static void applyMonitoringOptions(UA_MonitoredItemCreateRequest *item, struct MonitoringOptions *options) {
+    item->requestedParameters.samplingInterval = options->samplingInterval;
+    item->requestedParameters.queueSize = options->queueSize;
+    item->requestedParameters.discardOldest = options->discardOldest;
+
+    if (options->hasFilter) {
+        item->requestedParameters.filter.encoding = UA_EXTENSIONOBJECT_DECODED_NODELETE;
+        item->requestedParameters.filter.content.decoded.type = &UA_TYPES[UA_TYPES_DATACHANGEFILTER];
+        item->requestedParameters.filter.content.decoded.data = &options->dataChangeFilter;
+    }
+}
+
+struct CreateDataChangeCall {
+    UA_Client *client;
+    UA_UInt32 subscriptionId;
+    UA_MonitoredItemCreateRequest request;
+    void *context;
+    UA_MonitoredItemCreateResult result;
+};
+
+static void *createDataChangeWithoutGvl(void *ptr) {
+    struct CreateDataChangeCall *call = ptr;
+    call->result = UA_Client_MonitoredItems_createDataChange(call->client, call->subscriptionId,
+                                                             UA_TIMESTAMPSTORETURN_BOTH,
+                                                             call->request, call->context, handler_dataChanged,
+                                                             monitoredItemDeleted);
+    return NULL;
+}
+
+/* add_monitored_item(subscription, ns, name) or (subscription, node), with
+ * the options of monitoringOptionsFromRuby. The context: object is passed
+ * to the data change callbacks of the item. */
+static VALUE rb_addMonitoredItem(int argc, VALUE *argv, VALUE self) {
+    VALUE v_subscription, v_nodeArgs[2], v_opts;
+    argc = rb_scan_args(argc, argv, "21:", &v_subscription, &v_nodeArgs[0], &v_nodeArgs[1], &v_opts);
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_UInt32 subscriptionId = NUM2UINT(v_subscription); // TODO: check type
+
+    if (nodeIdArgsCount(argc - 1, v_nodeArgs) != argc - 1) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct MonitoringOptions options;
+    VALUE v_context;
+    monitoringOptionsFromRuby(v_opts, &options, "context", &v_context);
+
+    UA_NodeId monNodeId = nodeIdFromArgs(argc - 1, v_nodeArgs);
+
+    struct CreateDataChangeCall call = { client, subscriptionId, UA_MonitoredItemCreateRequest_default(monNodeId) };
+    applyMonitoringOptions(&call.request, &options);
+    call.context = newItemContext(ctx, v_context);
+    /* Kept if the call is skipped for a deferred exception */
+    call.result.statusCode = UA_STATUSCODE_BADREQUESTCANCELLEDBYCLIENT;
+    callWithoutGvl(ctx, createDataChangeWithoutGvl, &call);
+    UA_NodeId_deleteMembers(&monNodeId);
+
+    if (call.result.statusCode != UA_STATUSCODE_GOOD) {
+        freeItemContext(ctx, call.context);
+    }
+
+    raisePendingInterrupts(ctx);
+
+    UA_MonitoredItemCreateResult monResponse = call.result;
+    if (monResponse.statusCode == UA_STATUSCODE_GOOD) {
+        // printf("Request to monitor field successful, id %u\n", monResponse.monitoredItemId);
+        UA_UInt32 monitoredItemId = monResponse.monitoredItemId;
+        return UINT2NUM(monitoredItemId);
+    } else {
+        // printf("Request to monitor field failed: %s\n", UA_StatusCode_name(monResponse.statusCode));
+        return Qnil;
+    }
+}
+
+static void fetchOperationLimits(UA_Client *client, struct OpcuaClientContext *ctx);
+
+struct CreateDataChangesCall {
+    UA_Client *client;
+    UA_UInt32 subscriptionId;
+    UA_MonitoredItemCreateRequest *items;
+    void **contexts;
+    size_t itemsSize;
+    UA_MonitoredItemCreateResult *results;
+};
+
+/* Creates the items in slices of at most MaxMonitoredItemsPerCall. After a
+ * failed request, the remaining items get its status without being sent. */
+static void *createDataChangesWithoutGvl(void *ptr) {
+    struct CreateDataChangesCall *call = ptr;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(call->client);
+
+    if (!ctx->operationLimitsRead && UA_Client_getState(call->client) >= UA_CLIENTSTATE_SESSION) {
+        fetchOperationLimits(call->client, ctx);
+    }
+
+    size_t maxItems = DEFAULT_MAX_MONITORED_ITEMS_PER_REQUEST;
+    if (ctx->maxMonitoredItemsPerCall > 0 && ctx->maxMonitoredItemsPerCall < maxItems) {
+        maxItems = ctx->maxMonitoredItemsPerCall;
+    }
+
+    size_t callbacksSize = call->itemsSize < maxItems ? call->itemsSize : maxItems;
+    UA_Client_DataChangeNotificationCallback *callbacks = UA_malloc(callbacksSize * sizeof(UA_Client_DataChangeNotificationCallback));
+    UA_Client_DeleteMonitoredItemCallback *deleteCallbacks = UA_malloc(callbacksSize * sizeof(UA_Client_DeleteMonitoredItemCallback));
+
+    UA_StatusCode failed = UA_STATUSCODE_GOOD;
+    if (!callbacks || !deleteCallbacks) {
+        failed = UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    for (size_t i=0; i<callbacksSize && failed == UA_STATUSCODE_GOOD; i++) {
+        callbacks[i] = handler_dataChanged;
+        deleteCallbacks[i] = monitoredItemDeleted;
+    }
+
+    for (size_t offset=0; offset<call->itemsSize; offset+=maxItems) {
+        size_t sliceSize = call->itemsSize - offset < maxItems ? call->itemsSize - offset : maxItems;
+
+        if (failed == UA_STATUSCODE_GOOD && blockingCallInterrupted()) {
+            failed = UA_STATUSCODE_BADREQUESTCANCELLEDBYCLIENT;
+        }
+
+        if (failed != UA_STATUSCODE_GOOD) {
+            for (size_t i=0; i<sliceSize; i++) {
+                call->results[offset + i].statusCode = failed;
+            }
+            continue;
+        }
+
+        UA_CreateMonitoredItemsRequest request;
+        UA_CreateMonitoredItemsRequest_init(&request);
+        request.subscriptionId = call->subscriptionId;
+        request.timestampsToReturn = UA_TIMESTAMPSTORETURN_BOTH;
+        request.itemsToCreate = &call->items[offset];
+        request.itemsToCreateSize = sliceSize;
+
+        UA_CreateMonitoredItemsResponse response =
+            UA_Client_MonitoredItems_createDataChanges(call->client, request, &call->contexts[offset],
+                                                       callbacks, deleteCallbacks);
+
+        if (response.responseHeader.serviceResult == UA_STATUSCODE_GOOD && response.resultsSize == sliceSize) {
+            for (size_t i=0; i<sliceSize; i++) {
+                call->results[offset + i] = response.results[i];
+            }
+        } else {
+            failed = response.responseHeader.serviceResult != UA_STATUSCODE_GOOD ?
+                response.responseHeader.serviceResult : UA_STATUSCODE_BADUNEXPECTEDERROR;
+
+            for (size_t i=0; i<sliceSize; i++) {
+                call->results[offset + i].statusCode = failed;
+            }
+        }
+
+        UA_CreateMonitoredItemsResponse_deleteMembers(&response);
+    }
+
+    UA_free(callbacks);
+    UA_free(deleteCallbacks);
+    return NULL;
+}
+
+/* add_monitored_items(subscription, ns, names) or (subscription, nodes)
+ * returns [monitored item id, status] for every node, the id being nil if
+ * the item could not be created. Options as for add_monitored_item, with
+ * contexts: holding one context per node. */
+static VALUE rb_addMonitoredItems(int argc, VALUE *argv, VALUE self) {
+    VALUE v_subscription, v_nodeArgs[2], v_opts;
+    argc = rb_scan_args(argc, argv, "21:", &v_subscription, &v_nodeArgs[0], &v_nodeArgs[1], &v_opts);
+
+    long nodesCount;
+
+    if (nodeIdsArgsCount(argc - 1, v_nodeArgs, &nodesCount) != argc - 1) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_UInt32 subscriptionId = NUM2UINT(v_subscription);
+
+    struct MonitoringOptions options;
+    VALUE v_contexts;
+    monitoringOptionsFromRuby(v_opts, &options, "contexts", &v_contexts);
+
+    if (!NIL_P(v_contexts) && (!RB_TYPE_P(v_contexts, T_ARRAY) || RARRAY_LEN(v_contexts) != nodesCount)) {
+        return raise_invalid_arguments_error();
+    }
+
+    if (nodesCount == 0) {
+        return rb_ary_new();
+    }
+
+    /* Raises for a bad name, so it goes before the contexts are taken */
+    UA_NodeId *nodes = nodeIdsFromArgs(argc - 1, v_nodeArgs);
+
+    VALUE v_buffer;
+    void **contexts = ALLOCV_N(void *, v_buffer, nodesCount);
+    for (long i=0; i<nodesCount; i++) {
+        contexts[i] = NIL_P(v_contexts) ? NULL : newItemContext(ctx, RARRAY_AREF(v_contexts, i));
+    }
+
+    UA_MonitoredItemCreateRequest *items = UA_malloc(nodesCount * sizeof(UA_MonitoredItemCreateRequest));
+    UA_MonitoredItemCreateResult *results = UA_calloc(nodesCount, sizeof(UA_MonitoredItemCreateResult));
+
+    /* The items point to the nodes, nothing else to free per item. Results
+     * stay cancelled if the call is skipped for a deferred exception. */
+    for (long i=0; i<nodesCount; i++) {
+        items[i] = UA_MonitoredItemCreateRequest_default(nodes[i]);
+        applyMonitoringOptions(&items[i], &options);
+        results[i].statusCode = UA_STATUSCODE_BADREQUESTCANCELLEDBYCLIENT;
+    }
+
+    struct CreateDataChangesCall call = { client, subscriptionId, items, contexts, nodesCount, results };
+    callWithoutGvl(ctx, createDataChangesWithoutGvl, &call);
+
+    for (long i=0; i<nodesCount; i++) {
+        if (results[i].statusCode != UA_STATUSCODE_GOOD) {
+            freeItemContext(ctx, contexts[i]);
+        }
+    }
+
+    VALUE resultArray = rb_ary_new2(nodesCount);
+
+    for (long i=0; i<nodesCount; i++) {
+        UA_StatusCode status = results[i].statusCode;
+        VALUE v_id = status == UA_STATUSCODE_GOOD ? UINT2NUM(results[i].monitoredItemId) : Qnil;
+        rb_ary_push(resultArray, rb_assoc_new(v_id, UINT2NUM(status)));
+    }
+
+    UA_Array_delete(results, nodesCount, &UA_TYPES[UA_TYPES_MONITOREDITEMCREATERESULT]);
+    UA_free(items);
+    UA_free(nodes);
+    ALLOCV_END(v_buffer);
+
+    raisePendingInterrupts(ctx);
+    return resultArray;
+}
+
+struct DisconnectCall {
+    UA_Client *client;
+    UA_StatusCode status;
+};
+
+static void *disconnectWithoutGvl(void *ptr) {
+    struct DisconnectCall *call = ptr;
+    call->status = UA_Client_disconnect(call->client);
+    return NULL;
+}
+
+static VALUE rb_disconnect(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    struct DisconnectCall call = { client, 0 };
+    callWithoutGvl(ctx, disconnectWithoutGvl, &call);
+    raisePendingInterrupts(ctx);
+
+    UA_StatusCode status = call.status;
+    return RB_UINT2NUM(status);
+}
+
+struct RegisterNodesCall {
+    UA_Client *client;
+    UA_RegisterNodesRequest request;
+    UA_RegisterNodesResponse response;
+};
+
+static void *registerNodesWithoutGvl(void *ptr) {
+    struct RegisterNodesCall *call = ptr;
+    call->response = UA_Client_Service_registerNodes(call->client, call->request);
+    return NULL;
+}
+
+struct UnregisterNodesCall {
+    UA_Client *client;
+    UA_UnregisterNodesRequest request;
+    UA_UnregisterNodesResponse response;
+};
+
+static void *unregisterNodesWithoutGvl(void *ptr) {
+    struct UnregisterNodesCall *call = ptr;
+    call->response = UA_Client_Service_unregisterNodes(call->client, call->request);
+    return NULL;
+}
+
+/* Returns the aliases the server assigned to the nodes for this session */
+static VALUE rb_registerNodes(int argc, VALUE *argv, VALUE self) {
+    long namesCount;
+
+    if (nodeIdsArgsCount(argc, argv, &namesCount) != argc) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_NodeId *nodes = nodeIdsFromArgs(argc, argv);
+
+    struct RegisterNodesCall call = { client };
+    UA_RegisterNodesRequest_init(&call.request);
+    call.request.nodesToRegister = nodes;
+    call.request.nodesToRegisterSize = namesCount;
+
+    callWithoutGvl(ctx, registerNodesWithoutGvl, &call);
+    UA_free(nodes);
+
+    UA_RegisterNodesResponse *response = &call.response;
+    UA_StatusCode status = response->responseHeader.serviceResult;
+
+    if (status == UA_STATUSCODE_GOOD && response->registeredNodeIdsSize != (size_t)namesCount) {
+        status = UA_STATUSCODE_BADUNEXPECTEDERROR;
+    }
+
+    if (status != UA_STATUSCODE_GOOD) {
+        UA_RegisterNodesResponse_deleteMembers(response);
+        raisePendingInterrupts(ctx);
+        return raise_ua_status_error(status);
+    }
+
+    VALUE resultArray = rb_ary_new2(namesCount);
+
+    for (size_t i=0; i<response->registeredNodeIdsSize; i++) {
+        rb_ary_push(resultArray, newRubyNodeId(&response->registeredNodeIds[i]));
+    }
+
+    UA_RegisterNodesResponse_deleteMembers(response);
+
+    raisePendingInterrupts(ctx);
+    return resultArray;
+}
+
+static VALUE rb_unregisterNodes(VALUE self, VALUE v_aryNodes) {
+    Check_Type(v_aryNodes, T_ARRAY);
+    const long nodesCount = RARRAY_LEN(v_aryNodes);
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_NodeId *nodes = newNodeIdsFromRuby(v_aryNodes);
+
+    struct UnregisterNodesCall call = { client };
+    UA_UnregisterNodesRequest_init(&call.request);
+    call.request.nodesToUnregister = nodes;
+    call.request.nodesToUnregisterSize = nodesCount;
+
+    callWithoutGvl(ctx, unregisterNodesWithoutGvl, &call);
+    UA_free(nodes);
+
+    UA_StatusCode status = call.response.responseHeader.serviceResult;
+    UA_UnregisterNodesResponse_deleteMembers(&call.response);
+
+    raisePendingInterrupts(ctx);
+
+    if (status != UA_STATUSCODE_GOOD) {
+        return raise_ua_status_error(status);
+    }
+
+    return Qnil;
+}
+
+/* Where the item and result arrays of a request/response pair live, so that
+ * reads and writes share the slicing code below. */
+struct SlicedService {
+    const UA_DataType *requestType;
+    const UA_DataType *responseType;
+    const UA_DataType *itemType;
+    const UA_DataType *resultType;
+    size_t itemsSizeOffset;
+    size_t itemsOffset;
+    size_t resultsSizeOffset;
+    size_t resultsOffset;
+};
+
+static const struct SlicedService readService = {
+    &UA_TYPES[UA_TYPES_READREQUEST], &UA_TYPES[UA_TYPES_READRESPONSE],
+    &UA_TYPES[UA_TYPES_READVALUEID], &UA_TYPES[UA_TYPES_DATAVALUE],
+    offsetof(UA_ReadRequest, nodesToReadSize), offsetof(UA_ReadRequest, nodesToRead),
+    offsetof(UA_ReadResponse, resultsSize), offsetof(UA_ReadResponse, results),
+};
+
+static const struct SlicedService writeService = {
+    &UA_TYPES[UA_TYPES_WRITEREQUEST], &UA_TYPES[UA_TYPES_WRITERESPONSE],
+    &UA_TYPES[UA_TYPES_WRITEVALUE], &UA_TYPES[UA_TYPES_STATUSCODE],
+    offsetof(UA_WriteRequest, nodesToWriteSize), offsetof(UA_WriteRequest, nodesToWrite),
+    offsetof(UA_WriteResponse, resultsSize), offsetof(UA_WriteResponse, results),
+};
+
+#define MEMBER_AT(ptr, offset, type) (*(type *)((char *)(ptr) + (offset)))
+
+/* Encoded size of the items that fit into one request, 0 if the server set
+ * no limit on the size of its requests */
+static size_t maxRequestItemsBytes(UA_Client *client) {
+    UA_ConnectionConfig remote = UA_Client_getRemoteConnectionConfig(client);
+    size_t maxBytes = remote.maxMessageSize;
+
+    if (remote.maxChunkCount > 0 && remote.recvBufferSize > CHUNK_HEADER_SIZE) {
+        size_t chunksBytes = (size_t)remote.maxChunkCount * (remote.recvBufferSize - CHUNK_HEADER_SIZE);
+
+        if (maxBytes == 0 || chunksBytes < maxBytes) {
+            maxBytes = chunksBytes;
+        }
+    }
+
+    if (maxBytes == 0) {
+        return 0;
+    }
+
+    return maxBytes > REQUEST_HEADERS_SIZE ? maxBytes - REQUEST_HEADERS_SIZE : 1;
+}
+
+/* Number of items, starting at offset, that go into one request. An item
+ * larger than maxBytes on its own is still sent, for the server to reject. */
+static size_t sliceItemsCount(const struct SlicedService *service, const void *items, size_t offset,
+                              size_t itemsSize, size_t maxItems, size_t maxBytes) {
+    size_t count = itemsSize - offset < maxItems ? itemsSize - offset : maxItems;
+
+    if (maxBytes == 0) {
+        return count;
+    }
+
+    size_t bytes = 0;
+
+    for (size_t i=0; i<count; i++) {
+        bytes += UA_calcSizeBinary((char *)items + (offset + i) * service->itemType->memSize, service->itemType);
+
+        if (bytes > maxBytes) {
+            return i > 0 ? i : 1;
+        }
+    }
+
+    return count;
+}
+
+struct Pipeline {
+    const struct SlicedService *service;
+    void *results;
+    size_t inFlight;
+    size_t completed;
+    UA_StatusCode status;
+};
+
+struct Slice {
+    struct Pipeline *pipeline;
+    size_t offset;
+    size_t count;
+    UA_UInt32 requestId;
+    int pending;
+};
+
+/* Moves the results of one slice into their place in the combined array */
+static void
+sliceDone(UA_Client *client, void *userdata, UA_UInt32 requestId, void *response, const UA_DataType *responseType) {
+    struct Slice *slice = userdata;
+    struct Pipeline *pipeline = slice->pipeline;
+    const struct SlicedService *service = pipeline->service;
+
+    slice->pending = 0;
+    pipeline->inFlight--;
+    pipeline->completed++;
+
+    UA_StatusCode status = ((UA_ResponseHeader *)response)->serviceResult;
+    size_t resultsSize = MEMBER_AT(response, service->resultsSizeOffset, size_t);
+    void **results = &MEMBER_AT(response, service->resultsOffset, void *);
+
+    if (status == UA_STATUSCODE_GOOD && resultsSize != slice->count) {
+        status = UA_STATUSCODE_BADUNEXPECTEDERROR;
+    }
+
+    if (status != UA_STATUSCODE_GOOD) {
+        if (pipeline->status == UA_STATUSCODE_GOOD) {
+            pipeline->status = status;
+        }
+        return;
+    }
+
+    size_t memSize = service->resultType->memSize;
+    memcpy((char *)pipeline->results + slice->offset * memSize, *results, resultsSize * memSize);
+    UA_free(*results);
+    *results = NULL;
+    MEMBER_AT(response, service->resultsSizeOffset, size_t) = 0;
+}
+
+/* Sends slices of the request as async services, keeping several on the wire,
+ * and returns one response with all results in the original order. */
+static void
+pipelinedService(UA_Client *client, const struct SlicedService *service, const void *request, void *response,
+                 size_t maxItems, size_t maxBytes) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    size_t itemsSize = MEMBER_AT(request, service->itemsSizeOffset, size_t);
+
+    UA_init(response, service->responseType);
+
+    struct Pipeline pipeline = { service };
+    pipeline.results = UA_Array_new(itemsSize, service->resultType);
+    struct Slice slices[MAX_PIPELINED_REQUESTS];
+    void *sliceRequest = UA_malloc(service->requestType->memSize);
+
+    if (!pipeline.results || !sliceRequest) {
+        UA_Array_delete(pipeline.results, itemsSize, service->resultType);
+        UA_free(sliceRequest);
+        ((UA_ResponseHeader *)response)->serviceResult = UA_STATUSCODE_BADOUTOFMEMORY;
+        return;
+    }
+
+    memset(slices, 0, sizeof(slices));
+    memcpy(sliceRequest, request, service->requestType->memSize);
+    const char *items = MEMBER_AT(request, service->itemsOffset, const char *);
+    size_t nextOffset = 0;
+    UA_DateTime maxDate = UA_DateTime_nowMonotonic() + ctx->requestTimeout * UA_DATETIME_MSEC;
+
+    for (;;) {
+        while (pipeline.status == UA_STATUSCODE_GOOD && nextOffset < itemsSize &&
+               pipeline.inFlight < MAX_PIPELINED_REQUESTS) {
+            struct Slice *slice = slices;
+            while (slice->pending) {
+                slice++;
+            }
+
+            slice->pipeline = &pipeline;
+            slice->offset = nextOffset;
+            slice->count = sliceItemsCount(service, items, nextOffset, itemsSize, maxItems, maxBytes);
+            slice->pending = 1;
+            pipeline.inFlight++;
+            nextOffset += slice->count;
+
+            MEMBER_AT(sliceRequest, service->itemsOffset, const void *) = items + slice->offset * service->itemType->memSize;
+            MEMBER_AT(sliceRequest, service->itemsSizeOffset, size_t) = slice->count;
+
+            UA_StatusCode status = __UA_Client_AsyncService(client, sliceRequest, service->requestType,
+                sliceDone, service->responseType, slice, &slice->requestId);
+
+            if (status != UA_STATUSCODE_GOOD) {
+                /* A failed send has called sliceDone, a failed allocation has not */
+                if (slice->pending) {
+                    slice->pending = 0;
+                    pipeline.inFlight--;
+                }
+
+                pipeline.status = status;
+            }
+        }
+
+        if (pipeline.inFlight == 0) {
+            break;
+        }
+
+        UA_DateTime now = UA_DateTime_nowMonotonic();
+        if (now >= maxDate) {
+            pipeline.status = UA_STATUSCODE_BADTIMEOUT;
+            break;
+        }
+
+        size_t completed = pipeline.completed;
+        UA_UInt32 timeout = (UA_UInt32)((maxDate - now + UA_DATETIME_MSEC - 1) / UA_DATETIME_MSEC);
+        UA_StatusCode status = UA_Client_receiveAsyncResponse(client, timeout);
+
+        if (status != UA_STATUSCODE_GOOD && status != UA_STATUSCODE_GOODNONCRITICALTIMEOUT) {
+            pipeline.status = status;
+            break;
+        }
+
+        if (pipeline.completed != completed) {
+            maxDate = UA_DateTime_nowMonotonic() + ctx->requestTimeout * UA_DATETIME_MSEC;
+        }
+    }
+
+    /* Responses still on the way could not be matched anymore, so the
+     * connection is closed like after a timed out synchronous service. */
+    if (pipeline.inFlight > 0) {
+        UA_Client_close(client);
+
+        for (size_t i=0; i<MAX_PIPELINED_REQUESTS; i++) {
+            if (slices[i].pending) {
+                UA_Client_AsyncService_cancelByRequestId(client, slices[i].requestId, pipeline.status);
+            }
+        }
+    }
+
+    if (pipeline.status == UA_STATUSCODE_GOOD) {
+        MEMBER_AT(response, service->resultsOffset, void *) = pipeline.results;
+        MEMBER_AT(response, service->resultsSizeOffset, size_t) = itemsSize;
+    } else {
+        UA_Array_delete(pipeline.results, itemsSize, service->resultType);
+        ((UA_ResponseHeader *)response)->serviceResult = pipeline.status;
+    }
+
+    UA_free(sliceRequest);
+}
+
+/* Reads the server's OperationLimits once per session. A limit of 0 means the
+ * server did not set one, or the read failed. */
+static void fetchOperationLimits(UA_Client *client, struct OpcuaClientContext *ctx) {
+    UA_ReadValueId rValues[3];
+    UA_ReadValueId_init(&rValues[0]);
+    UA_ReadValueId_init(&rValues[1]);
+    UA_ReadValueId_init(&rValues[2]);
+    rValues[0].nodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER_SERVERCAPABILITIES_OPERATIONLIMITS_MAXNODESPERREAD);
+    rValues[0].attributeId = UA_ATTRIBUTEID_VALUE;
+    rValues[1].nodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER_SERVERCAPABILITIES_OPERATIONLIMITS_MAXNODESPERWRITE);
+    rValues[1].attributeId = UA_ATTRIBUTEID_VALUE;
+    rValues[2].nodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_SERVER_SERVERCAPABILITIES_OPERATIONLIMITS_MAXMONITOREDITEMSPERCALL);
+    rValues[2].attributeId = UA_ATTRIBUTEID_VALUE;
+
+    UA_ReadRequest request;
+    UA_ReadRequest_init(&request);
+    request.nodesToRead = rValues;
+    request.nodesToReadSize = 3;
+
+    UA_ReadResponse response = UA_Client_Service_read(client, request);
+    UA_UInt32 *limits[3] = { &ctx->maxNodesPerRead, &ctx->maxNodesPerWrite, &ctx->maxMonitoredItemsPerCall };
+
+    for (size_t i=0; i<3; i++) {
+        *limits[i] = 0;
+
+        if (response.responseHeader.serviceResult == UA_STATUSCODE_GOOD && i < response.resultsSize &&
+            response.results[i].hasValue &&
+            UA_Variant_hasScalarType(&response.results[i].value, &UA_TYPES[UA_TYPES_UINT32])) {
+            *limits[i] = *(UA_UInt32 *)response.results[i].value.data;
+        }
+    }
+
+    /* A failed read is not repeated before the next session either */
+    ctx->operationLimitsRead = 1;
+    UA_ReadResponse_deleteMembers(&response);
+}
+
+static size_t maxNodesPerRequest(UA_Client *client, const struct SlicedService *service) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    size_t maxItems = DEFAULT_MAX_NODES_PER_REQUEST;
+
+    if (!ctx->operationLimitsRead && UA_Client_getState(client) >= UA_CLIENTSTATE_SESSION) {
+        fetchOperationLimits(client, ctx);
+    }
+
+    UA_UInt32 serverLimit = service == &readService ? ctx->maxNodesPerRead : ctx->maxNodesPerWrite;
+    if (serverLimit > 0 && serverLimit < maxItems) {
+        maxItems = serverLimit;
+    }
+
+    return maxItems;
+}
+
+/* Calls the service directly if the request is small, pipelined slices
+ * otherwise. Slices are bounded by the server's OperationLimits and by the
+ * size of the messages it accepts. */
+static void slicedService(UA_Client *client, const struct SlicedService *service, const void *request, void *response) {
+    size_t itemsSize = MEMBER_AT(request, service->itemsSizeOffset, size_t);
+    const void *items = MEMBER_AT(request, service->itemsOffset, const void *);
+    size_t maxItems = maxNodesPerRequest(client, service);
+    size_t maxBytes = maxRequestItemsBytes(client);
+
+    if (sliceItemsCount(service, items, 0, itemsSize, maxItems, maxBytes) == itemsSize) {
+        __UA_Client_Service(client, request, service->requestType, response, service->responseType);
+    } else {
+        pipelinedService(client, service, request, response, maxItems, maxBytes);
+    }
+}
+
+static UA_ReadResponse slicedRead(UA_Client *client, const UA_ReadRequest *request) {
+    UA_ReadResponse response;
+    slicedService(client, &readService, request, &response);
+    return response;
+}
+
+static UA_WriteResponse slicedWrite(UA_Client *client, const UA_WriteRequest *request) {
+    UA_WriteResponse response;
+    slicedService(client, &writeService, request, &response);
+    return response;
+}
+
+static UA_StatusCode multiRead(UA_Client *client, const UA_NodeId *nodeId, UA_Variant *out, const long varsCount) {
+
+    UA_UInt16 rvSize = UA_TYPES[UA_TYPES_READVALUEID].memSize;
+    UA_ReadValueId *rValues = UA_calloc(varsCount, rvSize);
+
+    for (int i=0; i<varsCount; i++) {
+        UA_ReadValueId *readItem = &rValues[i];
+        readItem->nodeId = nodeId[i];
+        readItem->attributeId = UA_ATTRIBUTEID_VALUE;
+    }
+
+    UA_ReadRequest request;
+    UA_ReadRequest_init(&request);
+    request.nodesToRead = rValues;
+    request.nodesToReadSize = varsCount;
+
+    UA_ReadResponse response = slicedRead(client, &request);
+    UA_StatusCode retval = response.responseHeader.serviceResult;
+    if(retval == UA_STATUSCODE_GOOD) {
+        if(response.resultsSize == varsCount)
+            retval = response.results[0].status;
+        else
+            retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
+    }
+
+    if(retval != UA_STATUSCODE_GOOD) {
+        UA_ReadResponse_deleteMembers(&response);
+        UA_free(rValues);
+        return retval;
+    }
+
+    /* Set the StatusCode */
+    UA_DataValue *results = response.results;
+
+    if (response.resultsSize != varsCount) {
+        retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
+        UA_ReadResponse_deleteMembers(&response);
+        UA_free(rValues);
+        return retval;
+    }
+
+    for (int i=0; i<varsCount; i++) {
+        if ((results[i].hasStatus && results[i].status != UA_STATUSCODE_GOOD) || !results[i].hasValue) {
+            retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
+            UA_ReadResponse_deleteMembers(&response);
+            UA_free(rValues);
+            return retval;
+        }
+    }
+
+    for (int i=0; i<varsCount; i++) {
+        out[i] = results[i].value;
+        UA_Variant_init(&results[i].value);
+    }
+
+    UA_ReadResponse_deleteMembers(&response);
+    UA_free(rValues);
+    return retval;
+}
+
+/* With writeIfChanged, whether the value equals the shadow of the node, the
+ * value last written to it with a Good result */
+static int shadowUnchanged(struct OpcuaClientContext *ctx, const UA_NodeId *nodeId, const UA_Variant *value) {
+    const UA_Variant *shadow = nodeMapGet(&ctx->writeShadow, nodeId);
+    return shadow && variantsEqual(shadow, value);
+}
+
+/* Makes value the shadow of the node, once the server accepted it */
+static void updateShadow(struct OpcuaClientContext *ctx, const UA_NodeId *nodeId, const UA_Variant *value) {
+    UA_Variant *shadow = nodeMapPut(&ctx->writeShadow, nodeId);
+
+    if (shadow) {
+        UA_Variant_deleteMembers(shadow);
+        if (UA_Variant_copy(value, shadow) != UA_STATUSCODE_GOOD) {
+            UA_Variant_init(shadow);
+        }
+    }
+}
+
+/* Marks the items of statuses still waiting for their result */
+#define STATUS_PENDING 0xFFFFFFFF
+
+/* Writes the values, leaving out the unchanged ones with writeIfChanged.
+ * Fills statuses, if not NULL, with the result of each item (Good for the
+ * skipped ones) and returns the first bad status. */
+static UA_StatusCode multiWriteWithStatus(UA_Client *client, const UA_NodeId *nodeId, const UA_Variant *in,
+                                          const long varsSize, UA_StatusCode *statuses) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    UA_AttributeId attributeId = UA_ATTRIBUTEID_VALUE;
+
+    UA_UInt16 wvSize = UA_TYPES[UA_TYPES_WRITEVALUE].memSize;
+
+    UA_WriteValue *wValues = UA_calloc(varsSize, wvSize);
+    size_t writeSize = 0;
+
+    /* Nodes already written by this request. Their shadow is not up to date
+     * before the response, so later items for them are never skipped. */
+    struct NodeMap written = { sizeof(UA_Byte), 0, 0, NULL };
+    int skipUnchanged = ctx->writeIfChanged;
+
+    for (int i=0; i<varsSize; i++) {
+        if (skipUnchanged && !nodeMapGet(&written, &nodeId[i]) && shadowUnchanged(ctx, &nodeId[i], &in[i])) {
+            ctx->skippedItems++;
+            if (statuses) {
+                statuses[i] = UA_STATUSCODE_GOOD;
+            }
+            continue;
+        }
+
+        if (skipUnchanged && !nodeMapPut(&written, &nodeId[i])) {
+            skipUnchanged = 0;
+        }
+
+        if (statuses) {
+            statuses[i] = STATUS_PENDING;
+        }
+
+        UA_WriteValue *wValue = &wValues[writeSize++];
+        wValue->attributeId = attributeId;
+        wValue->nodeId = nodeId[i];
+        wValue->value.value = in[i];
+        wValue->value.hasValue = true;
+    }
+
+    nodeMapClear(&written, NULL);
+
+    if (varsSize > 0 && writeSize == 0) {
+        UA_free(wValues);
+        return UA_STATUSCODE_GOOD;
+    }
+
+    ctx->writtenItems += writeSize;
+
+    UA_WriteRequest wReq;
+    UA_WriteRequest_init(&wReq);
+    wReq.nodesToWrite = wValues;
+    wReq.nodesToWriteSize = writeSize;
+
+    UA_WriteResponse wResp = slicedWrite(client, &wReq);
+
+    UA_StatusCode retval = wResp.responseHeader.serviceResult;
+    if(retval == UA_STATUSCODE_GOOD) {
+        if(wResp.resultsSize == writeSize) {
+            retval = wResp.results[0];
+
+            for (size_t i=0; i<wResp.resultsSize; i++) {
+                if (wResp.results[i] != UA_STATUSCODE_GOOD) {
+                    retval = wResp.results[i];
+                    // printf("%s\n", "multiWrite: bad result found");
+                    break;
+                }
             }
 
             if (retval == UA_STATUSCODE_GOOD) {
                 // printf("%s\n", "multiWrite: all vars written");
             }
         } else {
-            retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
-            // printf("%s\n", "multiWrite: bad resultsSize");
+            retval = UA_STATUSCODE_BADUNEXPECTEDERROR;
+            // printf("%s\n", "multiWrite: bad resultsSize");
+        }
+    } else {
+        // printf("%s\n", "multiWrite: bad write");
+    }
+
+    if (statuses) {
+        int fromResults = wResp.responseHeader.serviceResult == UA_STATUSCODE_GOOD && wResp.resultsSize == writeSize;
+
+        size_t k = 0;
+
+        for (long i=0; i<varsSize; i++) {
+            if (statuses[i] == STATUS_PENDING) {
+                statuses[i] = fromResults ? wResp.results[k++] : retval;
+            }
+        }
+    }
+
+    if (ctx->writeIfChanged) {
+        if (wResp.responseHeader.serviceResult == UA_STATUSCODE_GOOD && wResp.resultsSize == writeSize) {
+            for (size_t i=0; i<writeSize; i++) {
+                if (wResp.results[i] == UA_STATUSCODE_GOOD) {
+                    updateShadow(ctx, &wValues[i].nodeId, &wValues[i].value.value);
+                }
+            }
+        } else {
+            /* Which of the values reached the server is unknown */
+            nodeMapClear(&ctx->writeShadow, freeShadowValue);
+        }
+    }
+
+    UA_WriteResponse_deleteMembers(&wResp);
+    UA_free(wValues);
+
+    return retval;
+}
+
+static UA_StatusCode multiWrite(UA_Client *client, const UA_NodeId *nodeId, const UA_Variant *in, const long varsSize) {
+    return multiWriteWithStatus(client, nodeId, in, varsSize, NULL);
+}
+
+struct MultiCall {
+    UA_Client *client;
+    const UA_NodeId *nodes;
+    UA_Variant *values;
+    long varsCount;
+    UA_StatusCode status;
+};
+
+static void *multiReadWithoutGvl(void *ptr) {
+    struct MultiCall *call = ptr;
+    call->status = multiRead(call->client, call->nodes, call->values, call->varsCount);
+    return NULL;
+}
+
+static void *multiWriteWithoutGvl(void *ptr) {
+    struct MultiCall *call = ptr;
+    call->status = multiWrite(call->client, call->nodes, call->values, call->varsCount);
+    return NULL;
+}
+
+/* Element types whose arrays are handed to Ruby as packed binary Strings,
+ * copied with one memcpy from the decoded variant. */
+static const struct {
+    UA_UInt16 typeIndex;
+    const char *name;
+} packedArrayTypes[] = {
+    { UA_TYPES_BOOLEAN, "boolean" },
+    { UA_TYPES_SBYTE, "sbyte" },
+    { UA_TYPES_BYTE, "byte" },
+    { UA_TYPES_INT16, "int16" },
+    { UA_TYPES_UINT16, "uint16" },
+    { UA_TYPES_INT32, "int32" },
+    { UA_TYPES_UINT32, "uint32" },
+    { UA_TYPES_INT64, "int64" },
+    { UA_TYPES_UINT64, "uint64" },
+    { UA_TYPES_FLOAT, "float" },
+    { UA_TYPES_DOUBLE, "double" },
+};
+
+static const char *packedArrayTypeName(const UA_Variant *value) {
+    if (!value->type || UA_Variant_isScalar(value)) {
+        return NULL;
+    }
+
+    for (size_t i=0; i<sizeof(packedArrayTypes) / sizeof(packedArrayTypes[0]); i++) {
+        if (value->type == &UA_TYPES[packedArrayTypes[i].typeIndex]) {
+            return packedArrayTypes[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+static VALUE toRubyPackedArray(const UA_Variant *value) {
+    return rb_str_new((const char *)value->data, value->arrayLength * value->type->memSize);
+}
+
+typedef VALUE (*ScalarConverter)(const void *data);
+
+static VALUE booleanToRuby(const void *data) { return *(const UA_Boolean *)data ? Qtrue : Qfalse; }
+static VALUE sbyteToRuby(const void *data) { return INT2FIX(*(const UA_SByte *)data); }
+static VALUE byteToRuby(const void *data) { return INT2FIX(*(const UA_Byte *)data); }
+static VALUE int16ToRuby(const void *data) { return INT2FIX(*(const UA_Int16 *)data); }
+static VALUE uint16ToRuby(const void *data) { return INT2FIX(*(const UA_UInt16 *)data); }
+static VALUE int32ToRuby(const void *data) { return INT2NUM(*(const UA_Int32 *)data); }
+static VALUE uint32ToRuby(const void *data) { return UINT2NUM(*(const UA_UInt32 *)data); }
+static VALUE int64ToRuby(const void *data) { return LL2NUM(*(const UA_Int64 *)data); }
+static VALUE uint64ToRuby(const void *data) { return ULL2NUM(*(const UA_UInt64 *)data); }
+static VALUE floatToRuby(const void *data) { return DBL2NUM(*(const UA_Float *)data); }
+static VALUE doubleToRuby(const void *data) { return DBL2NUM(*(const UA_Double *)data); }
+static VALUE dateTimeToRuby(const void *data) { return toRubyTime(*(const UA_DateTime *)data); }
+static VALUE guidToRuby(const void *data) { return toRubyGuid(data); }
+static VALUE nodeIdToRuby(const void *data) { return newRubyNodeId(data); }
+static VALUE statusCodeToRuby(const void *data) { return UINT2NUM(*(const UA_StatusCode *)data); }
+
+static VALUE stringToRuby(const void *data) {
+    const UA_String *str = data;
+    return rb_utf8_str_new((const char *)str->data, str->length);
+}
+
+static VALUE byteStringToRuby(const void *data) {
+    const UA_ByteString *str = data;
+    return rb_str_new((const char *)str->data, str->length);
+}
+
+/* The namespace URI and server index are dropped */
+static VALUE expandedNodeIdToRuby(const void *data) {
+    return newRubyNodeId(&((const UA_ExpandedNodeId *)data)->nodeId);
+}
+
+/* "<ns>:<name>", the usual notation of browse names */
+static VALUE qualifiedNameToRuby(const void *data) {
+    const UA_QualifiedName *name = data;
+    return rb_enc_sprintf(rb_utf8_encoding(), "%u:%.*s", name->namespaceIndex,
+                          (int)name->name.length, (const char *)name->name.data);
+}
+
+/* The locale is dropped */
+static VALUE localizedTextToRuby(const void *data) {
+    return stringToRuby(&((const UA_LocalizedText *)data)->text);
+}
+
+static VALUE toRubyScalar(const UA_DataType *type, const void *data);
+
+static VALUE extensionObjectToRuby(const void *data) {
+    const UA_ExtensionObject *obj = data;
+    if (obj->encoding != UA_EXTENSIONOBJECT_DECODED && obj->encoding != UA_EXTENSIONOBJECT_DECODED_NODELETE) {
+        return Qnil;
+    }
+    return toRubyScalar(obj->content.decoded.type, obj->content.decoded.data);
+}
+
+static VALUE dataValueToRuby(const void *data) {
+    const UA_DataValue *value = data;
+    return value->hasValue ? toRubyValue(&value->value) : Qnil;
+}
+
+static VALUE variantToRuby(const void *data) {
+    return toRubyValue(data);
+}
+
+/* Indexed by UA_DataType typeIndex, NULL entries convert to nil */
+static const ScalarConverter scalarConverters[UA_TYPES_COUNT] = {
+    [UA_TYPES_BOOLEAN] = booleanToRuby,
+    [UA_TYPES_SBYTE] = sbyteToRuby,
+    [UA_TYPES_BYTE] = byteToRuby,
+    [UA_TYPES_INT16] = int16ToRuby,
+    [UA_TYPES_UINT16] = uint16ToRuby,
+    [UA_TYPES_INT32] = int32ToRuby,
+    [UA_TYPES_UINT32] = uint32ToRuby,
+    [UA_TYPES_INT64] = int64ToRuby,
+    [UA_TYPES_UINT64] = uint64ToRuby,
+    [UA_TYPES_FLOAT] = floatToRuby,
+    [UA_TYPES_DOUBLE] = doubleToRuby,
+    [UA_TYPES_STRING] = stringToRuby,
+    [UA_TYPES_DATETIME] = dateTimeToRuby,
+    [UA_TYPES_GUID] = guidToRuby,
+    [UA_TYPES_BYTESTRING] = byteStringToRuby,
+    [UA_TYPES_XMLELEMENT] = stringToRuby,
+    [UA_TYPES_NODEID] = nodeIdToRuby,
+    [UA_TYPES_EXPANDEDNODEID] = expandedNodeIdToRuby,
+    [UA_TYPES_STATUSCODE] = statusCodeToRuby,
+    [UA_TYPES_QUALIFIEDNAME] = qualifiedNameToRuby,
+    [UA_TYPES_LOCALIZEDTEXT] = localizedTextToRuby,
+    [UA_TYPES_EXTENSIONOBJECT] = extensionObjectToRuby,
+    [UA_TYPES_DATAVALUE] = dataValueToRuby,
+    [UA_TYPES_VARIANT] = variantToRuby,
+};
+
+static VALUE toRubyScalar(const UA_DataType *type, const void *data) {
+    /* typeIndex is only meaningful for types of the UA_TYPES table */
+    if (type < UA_TYPES || type >= UA_TYPES + UA_TYPES_COUNT) {
+        return Qnil;
+    }
+
+    ScalarConverter converter = scalarConverters[type->typeIndex];
+    return converter ? converter(data) : Qnil;
+}
+
+static VALUE toRubyValue(const UA_Variant *value) {
+    if (!value->type) {
+        return Qnil;
+    }
+
+    if (UA_Variant_isScalar(value)) {
+        return toRubyScalar(value->type, value->data);
+    }
+
+    if (packedArrayTypeName(value)) {
+        return toRubyPackedArray(value);
+    }
+
+    VALUE result = rb_ary_new_capa(value->arrayLength);
+    const char *element = value->data;
+    for (size_t i=0; i<value->arrayLength; i++) {
+        rb_ary_push(result, toRubyScalar(value->type, element));
+        element += value->type->memSize;
+    }
+
+    return result;
+}
+
+static VALUE rb_readUaValues(int argc, VALUE *argv, VALUE self) {
+    long namesCount;
+
+    if (nodeIdsArgsCount(argc, argv, &namesCount) != argc) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_UInt16 variantSize = UA_TYPES[UA_TYPES_VARIANT].memSize;
+
+    UA_NodeId *nodes = nodeIdsFromArgs(argc, argv);
+    UA_Variant *readValues = UA_calloc(namesCount, variantSize);
+
+    struct MultiCall call = { client, nodes, readValues, namesCount, 0 };
+    callWithoutGvl(ctx, multiReadWithoutGvl, &call);
+    UA_StatusCode status = call.status;
+
+    VALUE resultArray = Qnil;
+
+    if (status == UA_STATUSCODE_GOOD) {
+        // printf("%s\n", "value read successful");
+
+        resultArray = rb_ary_new2(namesCount);
+
+        for (int i=0; i<namesCount; i++) {
+            // printf("the value is: %i\n", val);
+
+            VALUE rubyVal = toRubyValue(&readValues[i]);
+            rb_ary_push(resultArray, rubyVal);
+        }
+    } else {
+        /* Clean up */
+        for (int i=0; i<namesCount; i++) {
+            UA_Variant_deleteMembers(&readValues[i]);
+        }
+        UA_free(nodes);
+        UA_free(readValues);
+
+        raisePendingInterrupts(ctx);
+        return raise_ua_status_error(status);
+    }
+
+    /* Clean up */
+    for (int i=0; i<namesCount; i++) {
+        UA_Variant_deleteMembers(&readValues[i]);
+    }
+    UA_free(nodes);
+    UA_free(readValues);
+
+    raisePendingInterrupts(ctx);
+    return resultArray;
+}
+
+struct ReadCall {
+    UA_Client *client;
+    UA_ReadRequest request;
+    UA_ReadResponse response;
+};
+
+static void *readWithoutGvl(void *ptr) {
+    struct ReadCall *call = ptr;
+    call->response = slicedRead(call->client, &call->request);
+    return NULL;
+}
+
+static VALUE toRubyReadResults(const struct OpcuaClientContext *ctx, const UA_ReadResponse *response) {
+    VALUE resultArray = rb_ary_new2(response->resultsSize);
+
+    for (size_t i=0; i<response->resultsSize; i++) {
+        UA_DataValue *result = &response->results[i];
+
+        VALUE v_value = result->hasValue ? toRubyValue(&result->value) : Qnil;
+        VALUE v_status = UINT2NUM(result->hasStatus ? result->status : UA_STATUSCODE_GOOD);
+        VALUE v_serverTime = result->hasServerTimestamp ? toRubyTimestamp(ctx, result->serverTimestamp) : Qnil;
+        VALUE v_sourceTime = result->hasSourceTimestamp ? toRubyTimestamp(ctx, result->sourceTimestamp) : Qnil;
+
+        rb_ary_push(resultArray, rb_ary_new3(4, v_value, v_status, v_serverTime, v_sourceTime));
+    }
+
+    return resultArray;
+}
+
+/* Returns [value, status, server_time, source_time] for every node. Only a
+ * failed service raises, a bad node is reported in its own status. */
+static VALUE rb_readUaValuesWithStatus(int argc, VALUE *argv, VALUE self) {
+    long namesCount;
+
+    if (nodeIdsArgsCount(argc, argv, &namesCount) != argc) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_NodeId *nodes = nodeIdsFromArgs(argc, argv);
+    UA_ReadValueId *rValues = UA_calloc(namesCount, UA_TYPES[UA_TYPES_READVALUEID].memSize);
+
+    for (int i=0; i<namesCount; i++) {
+        rValues[i].nodeId = nodes[i];
+        rValues[i].attributeId = UA_ATTRIBUTEID_VALUE;
+    }
+
+    struct ReadCall call = { client };
+    UA_ReadRequest_init(&call.request);
+    call.request.nodesToRead = rValues;
+    call.request.nodesToReadSize = namesCount;
+    call.request.timestampsToReturn = UA_TIMESTAMPSTORETURN_BOTH;
+
+    callWithoutGvl(ctx, readWithoutGvl, &call);
+    UA_free(rValues);
+    UA_free(nodes);
+
+    UA_ReadResponse *response = &call.response;
+    UA_StatusCode status = response->responseHeader.serviceResult;
+
+    if (status == UA_STATUSCODE_GOOD && response->resultsSize != (size_t)namesCount) {
+        status = UA_STATUSCODE_BADUNEXPECTEDERROR;
+    }
+
+    if (status != UA_STATUSCODE_GOOD) {
+        UA_ReadResponse_deleteMembers(response);
+        raisePendingInterrupts(ctx);
+        return raise_ua_status_error(status);
+    }
+
+    VALUE resultArray = toRubyReadResults(ctx, response);
+    UA_ReadResponse_deleteMembers(response);
+
+    raisePendingInterrupts(ctx);
+    return resultArray;
+}
+
+static void ReadPlan_mark(void *ptr) {
+    struct ReadPlan *plan = ptr;
+    rb_gc_mark(plan->registeredClient);
+}
+
+static void ReadPlan_free(void *ptr) {
+    struct ReadPlan *plan = ptr;
+    if (plan->nodeIds) {
+        UA_Array_delete(plan->nodeIds, plan->request.nodesToReadSize, &UA_TYPES[UA_TYPES_NODEID]);
+    }
+    UA_ReadRequest_deleteMembers(&plan->request);
+    for (size_t i=0; i<=UA_TIMESTAMPSTORETURN_NEITHER; i++) {
+        UA_ByteString_deleteMembers(&plan->encodedBodies[i]);
+    }
+    xfree(plan);
+}
+
+static size_t ReadPlan_memsize(const void *ptr) {
+    const struct ReadPlan *plan = ptr;
+    size_t size = sizeof(struct ReadPlan) + plan->request.nodesToReadSize * sizeof(UA_ReadValueId);
+    for (size_t i=0; i<=UA_TIMESTAMPSTORETURN_NEITHER; i++) {
+        size += plan->encodedBodies[i].length;
+    }
+    return size;
+}
+
+static const rb_data_type_t ReadPlan_Type = {
+    "OPCUAClient::ReadPlan",
+    { ReadPlan_mark, ReadPlan_free, ReadPlan_memsize },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE allocateReadPlan(VALUE klass) {
+    struct ReadPlan *plan = ALLOC(struct ReadPlan);
+    UA_ReadRequest_init(&plan->request);
+    for (size_t i=0; i<=UA_TIMESTAMPSTORETURN_NEITHER; i++) {
+        UA_ByteString_init(&plan->encodedBodies[i]);
+    }
+    plan->registerNodes = 0;
+    plan->nodeIds = NULL;
+    plan->registeredClient = Qnil;
+    plan->registeredSession = 0;
+
+    return TypedData_Wrap_Struct(klass, &ReadPlan_Type, plan);
+}
+
+/* ReadPlan.new(ns, names, register: false) or ReadPlan.new(nodes, register: false) */
+static VALUE rb_initializeReadPlan(int argc, VALUE *argv, VALUE self) {
+    VALUE v_first, v_aryNames, v_opts;
+    rb_scan_args(argc, argv, "11:", &v_first, &v_aryNames, &v_opts);
+
+    int registerNodes = 0;
+
+    if (!NIL_P(v_opts)) {
+        ID kwargs[1] = { rb_intern("register") };
+        VALUE v_register;
+        rb_get_kwargs(v_opts, kwargs, 0, 1, &v_register);
+
+        registerNodes = v_register != Qundef && RTEST(v_register);
+    }
+
+    UA_NodeId *nodes;
+    long namesCount;
+
+    if (NIL_P(v_aryNames)) {
+        Check_Type(v_first, T_ARRAY);
+        namesCount = RARRAY_LEN(v_first);
+        nodes = newNodeIdsFromRuby(v_first);
+    } else {
+        if (RB_TYPE_P(v_first, T_FIXNUM) != 1) {
+            return raise_invalid_arguments_error();
+        }
+
+        Check_Type(v_aryNames, T_ARRAY);
+        namesCount = RARRAY_LEN(v_aryNames);
+        nodes = newStringNodeIds(FIX2INT(v_first), v_aryNames);
+    }
+
+    struct ReadPlan *plan;
+    TypedData_Get_Struct(self, struct ReadPlan, &ReadPlan_Type, plan);
+
+    if (plan->request.nodesToReadSize > 0) {
+        UA_free(nodes);
+        rb_raise(cError, "ReadPlan already initialized");
+    }
+
+    UA_ReadValueId *rValues = UA_Array_new(namesCount, &UA_TYPES[UA_TYPES_READVALUEID]);
+
+    for (int i=0; i<namesCount; i++) {
+        rValues[i].attributeId = UA_ATTRIBUTEID_VALUE;
+        UA_NodeId_copy(&nodes[i], &rValues[i].nodeId);
+    }
+
+    if (registerNodes) {
+        UA_StatusCode status = UA_Array_copy(nodes, namesCount, (void **)&plan->nodeIds, &UA_TYPES[UA_TYPES_NODEID]);
+        if (status != UA_STATUSCODE_GOOD) {
+            UA_free(nodes);
+            UA_Array_delete(rValues, namesCount, &UA_TYPES[UA_TYPES_READVALUEID]);
+            raise_ua_status_error(status);
+        }
+        plan->registerNodes = 1;
+    }
+
+    UA_free(nodes);
+
+    plan->request.nodesToRead = rValues;
+    plan->request.nodesToReadSize = namesCount;
+
+    return Qnil;
+}
+
+static VALUE rb_readPlanSize(VALUE self) {
+    struct ReadPlan *plan;
+    TypedData_Get_Struct(self, struct ReadPlan, &ReadPlan_Type, plan);
+
+    return SIZET2NUM(plan->request.nodesToReadSize);
+}
+
+struct EncodedReadCall {
+    UA_Client *client;
+    UA_RequestHeader requestHeader;
+    const UA_ByteString *body;
+    UA_ReadResponse response;
+};
+
+static void *encodedReadWithoutGvl(void *ptr) {
+    struct EncodedReadCall *call = ptr;
+    __UA_Client_Service_encodedBody(call->client, &call->requestHeader, call->body,
+        &UA_TYPES[UA_TYPES_READREQUEST], &call->response, &UA_TYPES[UA_TYPES_READRESPONSE]);
+    return NULL;
+}
+
+/* Swaps the nodes of a register: true plan for aliases registered in the
+ * client's current session, unless that was done already. */
+static void registerReadPlan(VALUE self, struct ReadPlan *plan, UA_Client *client, struct OpcuaClientContext *ctx) {
+    if (!plan->registerNodes) {
+        return;
+    }
+
+    if (!NIL_P(plan->registeredClient) && plan->registeredClient != self) {
+        rb_raise(cError, "ReadPlan is registered with another client");
+    }
+
+    if (plan->registeredClient == self && plan->registeredSession == ctx->sessionCount) {
+        return;
+    }
+
+    struct RegisterNodesCall call = { client };
+    UA_RegisterNodesRequest_init(&call.request);
+    call.request.nodesToRegister = plan->nodeIds;
+    call.request.nodesToRegisterSize = plan->request.nodesToReadSize;
+
+    callWithoutGvl(ctx, registerNodesWithoutGvl, &call);
+
+    UA_RegisterNodesResponse *response = &call.response;
+    UA_StatusCode status = response->responseHeader.serviceResult;
+
+    if (status == UA_STATUSCODE_GOOD && response->registeredNodeIdsSize != plan->request.nodesToReadSize) {
+        status = UA_STATUSCODE_BADUNEXPECTEDERROR;
+    }
+
+    if (status != UA_STATUSCODE_GOOD) {
+        UA_RegisterNodesResponse_deleteMembers(response);
+        raisePendingInterrupts(ctx);
+        raise_ua_status_error(status);
+    }
+
+    for (size_t i=0; i<plan->request.nodesToReadSize; i++) {
+        UA_NodeId_deleteMembers(&plan->request.nodesToRead[i].nodeId);
+        plan->request.nodesToRead[i].nodeId = response->registeredNodeIds[i];
+        UA_NodeId_init(&response->registeredNodeIds[i]);
+    }
+
+    for (size_t i=0; i<=UA_TIMESTAMPSTORETURN_NEITHER; i++) {
+        UA_ByteString_deleteMembers(&plan->encodedBodies[i]);
+    }
+
+    UA_RegisterNodesResponse_deleteMembers(response);
+    plan->registeredClient = self;
+    plan->registeredSession = ctx->sessionCount;
+}
+
+/* Returns the cached body of the plan's request, encoding it on first use.
+ * A body is only freed when the nodes of a register: true plan change, which
+ * happens under the lock of the one client reading that plan. */
+static const UA_ByteString *readPlanBody(struct ReadPlan *plan, UA_TimestampsToReturn timestamps) {
+    UA_ByteString *body = &plan->encodedBodies[timestamps];
+
+    if (body->length == 0) {
+        UA_ReadRequest request = plan->request;
+        request.timestampsToReturn = timestamps;
+
+        UA_StatusCode status = UA_Client_encodeRequestBody(&request, &UA_TYPES[UA_TYPES_READREQUEST], body);
+        if (status != UA_STATUSCODE_GOOD) {
+            raise_ua_status_error(status);
+        }
+    }
+
+    return body;
+}
+
+struct PlanRead {
+    VALUE self;
+    struct ReadPlan *plan;
+    UA_Client *client;
+    struct OpcuaClientContext *ctx;
+    UA_TimestampsToReturn timestamps;
+    UA_ReadResponse *response;
+};
+
+static VALUE sendReadPlan(VALUE ptr) {
+    struct PlanRead *read = (struct PlanRead *)ptr;
+
+    registerReadPlan(read->self, read->plan, read->client, read->ctx);
+
+    struct EncodedReadCall call = { read->client };
+    UA_RequestHeader_init(&call.requestHeader);
+    call.requestHeader.timeoutHint = read->plan->request.requestHeader.timeoutHint;
+    call.body = readPlanBody(read->plan, read->timestamps);
+
+    callWithoutGvl(read->ctx, encodedReadWithoutGvl, &call);
+    *read->response = call.response;
+    return Qnil;
+}
+
+static VALUE unlockClientAfterRead(VALUE ptr) {
+    struct PlanRead *read = (struct PlanRead *)ptr;
+    unlockClient(read->ctx);
+    return Qnil;
+}
+
+/* Sends the prepared request of a plan. Only the request header is encoded
+ * per call, because the client writes its session token and handle into it.
+ * The client stays locked from registering to the response, so the body
+ * sent cannot be freed by a new registration in the meantime. */
+static struct OpcuaClientContext *readPlan(VALUE self, VALUE v_plan, UA_TimestampsToReturn timestamps, UA_ReadResponse *response) {
+    struct ReadPlan *plan;
+    TypedData_Get_Struct(v_plan, struct ReadPlan, &ReadPlan_Type, plan);
+
+    if (plan->request.nodesToReadSize == 0) {
+        rb_raise(cError, "ReadPlan not initialized");
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    struct PlanRead read = { self, plan, client, ctx, timestamps, response };
+    lockClient(ctx);
+    rb_ensure(sendReadPlan, (VALUE)&read, unlockClientAfterRead, (VALUE)&read);
+    RB_GC_GUARD(v_plan);
+
+    UA_StatusCode status = response->responseHeader.serviceResult;
+
+    if (status == UA_STATUSCODE_GOOD && response->resultsSize != plan->request.nodesToReadSize) {
+        status = UA_STATUSCODE_BADUNEXPECTEDERROR;
+    }
+
+    if (status != UA_STATUSCODE_GOOD) {
+        UA_ReadResponse_deleteMembers(response);
+        raisePendingInterrupts(ctx);
+        raise_ua_status_error(status);
+    }
+
+    return ctx;
+}
+
+static VALUE rb_readWithPlan(VALUE self, VALUE v_plan) {
+    UA_ReadResponse response;
+    struct OpcuaClientContext *ctx = readPlan(self, v_plan, UA_TIMESTAMPSTORETURN_NEITHER, &response);
+
+    UA_StatusCode status = UA_STATUSCODE_GOOD;
+
+    for (size_t i=0; i<response.resultsSize && status == UA_STATUSCODE_GOOD; i++) {
+        UA_DataValue *result = &response.results[i];
+
+        if (result->hasStatus && result->status != UA_STATUSCODE_GOOD) {
+            status = result->status;
+        } else if (!result->hasValue) {
+            status = UA_STATUSCODE_BADUNEXPECTEDERROR;
+        }
+    }
+
+    if (status != UA_STATUSCODE_GOOD) {
+        UA_ReadResponse_deleteMembers(&response);
+        raisePendingInterrupts(ctx);
+        return raise_ua_status_error(status);
+    }
+
+    VALUE resultArray = rb_ary_new2(response.resultsSize);
+
+    for (size_t i=0; i<response.resultsSize; i++) {
+        rb_ary_push(resultArray, toRubyValue(&response.results[i].value));
+    }
+
+    UA_ReadResponse_deleteMembers(&response);
+
+    raisePendingInterrupts(ctx);
+
+    return resultArray;
+}
+
+static VALUE rb_readWithPlanAndStatus(VALUE self, VALUE v_plan) {
+    UA_ReadResponse response;
+    struct OpcuaClientContext *ctx = readPlan(self, v_plan, UA_TIMESTAMPSTORETURN_BOTH, &response);
+
+    VALUE resultArray = toRubyReadResults(ctx, &response);
+    UA_ReadResponse_deleteMembers(&response);
+
+    raisePendingInterrupts(ctx);
+
+    return resultArray;
+}
+
+/* Converts a Ruby value into data, returns 0 if it has the wrong type.
+ * Variable-length contents (strings) are copied to *buffer, which is moved
+ * past them; stagedSize reserved the space. */
+typedef int (*RubyConverter)(VALUE v_value, void *data, UA_Byte **buffer);
+
+static int booleanFromRuby(VALUE v_value, void *data, UA_Byte **buffer) {
+    if (RB_TYPE_P(v_value, T_TRUE) != 1 && RB_TYPE_P(v_value, T_FALSE) != 1) {
+        return 0;
+    }
+    *(UA_Boolean *)data = RTEST(v_value);
+    return 1;
+}
+
+static int sbyteFromRuby(VALUE v_value, void *data, UA_Byte **buffer) {
+    int value = NUM2INT(v_value);
+    if (value < UA_SBYTE_MIN || value > UA_SBYTE_MAX) {
+        return 0;
+    }
+    *(UA_SByte *)data = value;
+    return 1;
+}
+
+static int byteFromRuby(VALUE v_value, void *data, UA_Byte **buffer) {
+    int value = NUM2INT(v_value);
+    if (value < UA_BYTE_MIN || value > UA_BYTE_MAX) {
+        return 0;
+    }
+    *(UA_Byte *)data = value;
+    return 1;
+}
+
+static int int16FromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_Int16 *)data = NUM2SHORT(v_value); return 1; }
+static int uint16FromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_UInt16 *)data = NUM2USHORT(v_value); return 1; }
+static int int32FromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_Int32 *)data = NUM2INT(v_value); return 1; }
+static int uint32FromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_UInt32 *)data = NUM2UINT(v_value); return 1; }
+static int int64FromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_Int64 *)data = NUM2LL(v_value); return 1; }
+static int uint64FromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_UInt64 *)data = NUM2ULL(v_value); return 1; }
+static int floatFromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_Float *)data = NUM2DBL(v_value); return 1; }
+static int doubleFromRuby(VALUE v_value, void *data, UA_Byte **buffer) { *(UA_Double *)data = NUM2DBL(v_value); return 1; }
+
+/* Copies the bytes, the Ruby String may change while the GVL is released */
+static int stringFromRuby(VALUE v_value, void *data, UA_Byte **buffer) {
+    if (RB_TYPE_P(v_value, T_STRING) != 1) {
+        return 0;
+    }
+    UA_ByteString *str = data;
+    str->length = RSTRING_LEN(v_value);
+    if (str->length > 0) {
+        str->data = *buffer;
+        memcpy(str->data, RSTRING_PTR(v_value), str->length);
+        *buffer += STAGING_ALIGN(str->length);
+    }
+    return 1;
+}
+
+static int dateTimeFromRuby(VALUE v_value, void *data, UA_Byte **buffer) {
+    if (!rb_obj_is_kind_of(v_value, rb_cTime)) {
+        return 0;
+    }
+    struct timespec ts = rb_time_timespec(v_value);
+    *(UA_DateTime *)data = ts.tv_sec * UA_DATETIME_SEC + ts.tv_nsec / 100 + UA_DATETIME_UNIX_EPOCH;
+    return 1;
+}
+
+/* Types that the write methods accept, by the Symbol naming them */
+static const struct {
+    UA_UInt16 typeIndex;
+    const char *name;
+    RubyConverter fromRuby;
+} writableTypes[] = {
+    { UA_TYPES_BOOLEAN, "boolean", booleanFromRuby },
+    { UA_TYPES_SBYTE, "sbyte", sbyteFromRuby },
+    { UA_TYPES_BYTE, "byte", byteFromRuby },
+    { UA_TYPES_INT16, "int16", int16FromRuby },
+    { UA_TYPES_UINT16, "uint16", uint16FromRuby },
+    { UA_TYPES_INT32, "int32", int32FromRuby },
+    { UA_TYPES_UINT32, "uint32", uint32FromRuby },
+    { UA_TYPES_INT64, "int64", int64FromRuby },
+    { UA_TYPES_UINT64, "uint64", uint64FromRuby },
+    { UA_TYPES_FLOAT, "float", floatFromRuby },
+    { UA_TYPES_DOUBLE, "double", doubleFromRuby },
+    { UA_TYPES_STRING, "string", stringFromRuby },
+    { UA_TYPES_DATETIME, "datetime", dateTimeFromRuby },
+    { UA_TYPES_BYTESTRING, "bytestring", stringFromRuby },
+};
+
+#define WRITABLE_TYPES_COUNT (sizeof(writableTypes) / sizeof(writableTypes[0]))
+
+/* Index in writableTypes of a type Symbol, -1 if not writable */
+static int writableTypeFromSymbol(VALUE v_type) {
+    if (!SYMBOL_P(v_type)) {
+        return -1;
+    }
+
+    const char *name = rb_id2name(SYM2ID(v_type));
+    for (size_t i=0; i<WRITABLE_TYPES_COUNT; i++) {
+        if (strcmp(name, writableTypes[i].name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Index in writableTypes of a UA_TYPES index */
+static int writableTypeFromIndex(int typeIndex) {
+    for (size_t i=0; i<WRITABLE_TYPES_COUNT; i++) {
+        if (writableTypes[i].typeIndex == typeIndex) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Space needed to stage a value with stageValue */
+static size_t stagedSize(int writableType, VALUE v_value) {
+    size_t size = STAGING_ALIGN(UA_TYPES[writableTypes[writableType].typeIndex].memSize);
+
+    if (writableTypes[writableType].fromRuby == stringFromRuby && RB_TYPE_P(v_value, T_STRING)) {
+        size += STAGING_ALIGN(RSTRING_LEN(v_value));
+    }
+
+    return size;
+}
+
+/* Converts a value into the staging buffer at *buffer and points the variant
+ * at it. The variant does not own its data (NODELETE): the whole batch is
+ * released at once with the buffer. Raises if the value has the wrong type. */
+static void stageValue(UA_Variant *variant, int writableType, VALUE v_value, UA_Byte **buffer) {
+    const UA_DataType *type = &UA_TYPES[writableTypes[writableType].typeIndex];
+    void *data = *buffer;
+
+    memset(data, 0, type->memSize);
+    *buffer += STAGING_ALIGN(type->memSize);
+
+    if (!writableTypes[writableType].fromRuby(v_value, data, buffer)) {
+        raise_invalid_arguments_error();
+    }
+
+    UA_Variant_setScalar(variant, data, type);
+    variant->storageType = UA_VARIANT_DATA_NODELETE;
+}
+
+/* Space needed to stage an Array value with stageArray */
+static size_t stagedArraySize(int writableType, VALUE v_array) {
+    const long length = RARRAY_LEN(v_array);
+    size_t size = STAGING_ALIGN(length * UA_TYPES[writableTypes[writableType].typeIndex].memSize);
+
+    if (writableTypes[writableType].fromRuby == stringFromRuby) {
+        for (long i=0; i<length; i++) {
+            VALUE v_element = rb_ary_entry(v_array, i);
+            if (RB_TYPE_P(v_element, T_STRING)) {
+                size += STAGING_ALIGN(RSTRING_LEN(v_element));
+            }
+        }
+    }
+
+    return size;
+}
+
+/* Like stageValue, for a one-dimensional array */
+static void stageArray(UA_Variant *variant, int writableType, VALUE v_array, UA_Byte **buffer) {
+    const UA_DataType *type = &UA_TYPES[writableTypes[writableType].typeIndex];
+    const long length = RARRAY_LEN(v_array);
+    UA_Byte *data = *buffer;
+
+    memset(data, 0, length * type->memSize);
+    *buffer += STAGING_ALIGN(length * type->memSize);
+
+    for (long i=0; i<length; i++) {
+        if (!writableTypes[writableType].fromRuby(rb_ary_entry(v_array, i), data + i * type->memSize, buffer)) {
+            raise_invalid_arguments_error();
+        }
+    }
+
+    UA_Variant_setArray(variant, length > 0 ? (void *)data : UA_EMPTY_ARRAY_SENTINEL, length, type);
+    variant->storageType = UA_VARIANT_DATA_NODELETE;
+}
+
+/* Index in writableTypes for a value written without a type */
+static int writableTypeFromValue(VALUE v_value) {
+    UA_UInt16 typeIndex;
+
+    if (RB_TYPE_P(v_value, T_TRUE) || RB_TYPE_P(v_value, T_FALSE)) {
+        typeIndex = UA_TYPES_BOOLEAN;
+    } else if (RB_INTEGER_TYPE_P(v_value)) {
+        typeIndex = UA_TYPES_INT32;
+    } else if (RB_FLOAT_TYPE_P(v_value)) {
+        typeIndex = UA_TYPES_DOUBLE;
+    } else if (RB_TYPE_P(v_value, T_STRING)) {
+        typeIndex = UA_TYPES_STRING;
+    } else if (rb_obj_is_kind_of(v_value, rb_cTime)) {
+        typeIndex = UA_TYPES_DATETIME;
+    } else {
+        return -1;
+    }
+
+    return writableTypeFromIndex(typeIndex);
+}
+
+/* Namespace 0 subtypes of writable built-in types, encoded like them */
+static const struct {
+    UA_UInt32 dataType;
+    UA_UInt16 typeIndex;
+} builtinSubtypes[] = {
+    { UA_NS0ID_INTEGERID, UA_TYPES_UINT32 },
+    { UA_NS0ID_COUNTER, UA_TYPES_UINT32 },
+    { UA_NS0ID_DURATION, UA_TYPES_DOUBLE },
+    { UA_NS0ID_NUMERICRANGE, UA_TYPES_STRING },
+    { UA_NS0ID_TIME, UA_TYPES_STRING },
+    { UA_NS0ID_DATE, UA_TYPES_DATETIME },
+    { UA_NS0ID_UTCTIME, UA_TYPES_DATETIME },
+    { UA_NS0ID_LOCALEID, UA_TYPES_STRING },
+};
+
+static int writableTypeFromDataType(const UA_NodeId *dataType) {
+    if (dataType->namespaceIndex != 0 || dataType->identifierType != UA_NODEIDTYPE_NUMERIC) {
+        return -1;
+    }
+
+    for (size_t i=0; i<WRITABLE_TYPES_COUNT; i++) {
+        if (UA_TYPES[writableTypes[i].typeIndex].typeId.identifier.numeric == dataType->identifier.numeric) {
+            return i;
+        }
+    }
+
+    for (size_t i=0; i<sizeof(builtinSubtypes) / sizeof(builtinSubtypes[0]); i++) {
+        if (builtinSubtypes[i].dataType == dataType->identifier.numeric) {
+            return writableTypeFromIndex(builtinSubtypes[i].typeIndex);
+        }
+    }
+
+    return -1;
+}
+
+struct NodeTypesCall {
+    UA_Client *client;
+    struct NodeMap *nodeTypes;
+    const UA_NodeId **nodes;
+    size_t nodesCount;
+};
+
+/* Reads the DataType and ValueRank of the nodes in one (sliced) request and
+ * caches them. Nodes whose attributes could not be read are not cached. */
+static void *readNodeTypesWithoutGvl(void *ptr) {
+    struct NodeTypesCall *call = ptr;
+    UA_ReadValueId *rValues = UA_calloc(call->nodesCount * 2, sizeof(UA_ReadValueId));
+
+    if (!rValues) {
+        return NULL;
+    }
+
+    for (size_t i=0; i<call->nodesCount; i++) {
+        rValues[2 * i].nodeId = *call->nodes[i];
+        rValues[2 * i].attributeId = UA_ATTRIBUTEID_DATATYPE;
+        rValues[2 * i + 1].nodeId = *call->nodes[i];
+        rValues[2 * i + 1].attributeId = UA_ATTRIBUTEID_VALUERANK;
+    }
+
+    UA_ReadRequest request;
+    UA_ReadRequest_init(&request);
+    request.nodesToRead = rValues;
+    request.nodesToReadSize = call->nodesCount * 2;
+
+    UA_ReadResponse response = slicedRead(call->client, &request);
+
+    if (response.responseHeader.serviceResult == UA_STATUSCODE_GOOD && response.resultsSize == request.nodesToReadSize) {
+        for (size_t i=0; i<call->nodesCount; i++) {
+            const UA_DataValue *dataType = &response.results[2 * i];
+            const UA_DataValue *valueRank = &response.results[2 * i + 1];
+
+            if (!dataType->hasValue || !UA_Variant_hasScalarType(&dataType->value, &UA_TYPES[UA_TYPES_NODEID]) ||
+                !valueRank->hasValue || !UA_Variant_hasScalarType(&valueRank->value, &UA_TYPES[UA_TYPES_INT32])) {
+                continue;
+            }
+
+            struct NodeType *nodeType = nodeMapPut(call->nodeTypes, call->nodes[i]);
+            if (nodeType) {
+                nodeType->writableType = writableTypeFromDataType(dataType->value.data);
+                nodeType->valueRank = *(UA_Int32 *)valueRank->value.data;
+            }
+        }
+    }
+
+    UA_ReadResponse_deleteMembers(&response);
+    UA_free(rValues);
+    return NULL;
+}
+
+/* Copies the cached type of the node, if any. The cache is filled by calls
+ * running without the GVL, so it is only read under the client lock. */
+static int findNodeType(struct OpcuaClientContext *ctx, const UA_NodeId *nodeId, struct NodeType *nodeType) {
+    lockClient(ctx);
+    const struct NodeType *cached = nodeMapGet(&ctx->nodeTypes, nodeId);
+
+    if (cached) {
+        *nodeType = *cached;
+    }
+
+    unlockClient(ctx);
+    return cached != NULL;
+}
+
+/* Makes sure the types of the untyped entries are cached, with one read for
+ * all nodes seen for the first time */
+static void resolveNodeTypes(UA_Client *client, VALUE v_entries) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    const long count = RARRAY_LEN(v_entries);
+    VALUE v_buffer;
+    const UA_NodeId **nodes = ALLOCV_N(const UA_NodeId *, v_buffer, count);
+    size_t nodesCount = 0;
+
+    for (long i=0; i<count; i++) {
+        VALUE v_entry = rb_ary_entry(v_entries, i);
+
+        if (RARRAY_LEN(v_entry) == 2) {
+            const UA_NodeId *nodeId = rubyNodeId(rb_ary_entry(v_entry, 0));
+            struct NodeType nodeType;
+
+            if (!findNodeType(ctx, nodeId, &nodeType)) {
+                nodes[nodesCount++] = nodeId;
+            }
+        }
+    }
+
+    if (nodesCount > 0 && UA_Client_getState(client) >= UA_CLIENTSTATE_SESSION) {
+        struct NodeTypesCall call = { client, &ctx->nodeTypes, nodes, nodesCount };
+        callWithoutGvl(ctx, readNodeTypesWithoutGvl, &call);
+    }
+
+    ALLOCV_END(v_buffer);
+    RB_GC_GUARD(v_entries);
+    raisePendingInterrupts(ctx);
+}
+
+/* Type of a multi_write entry: [NodeId, Symbol type, value] or [NodeId, value].
+ * Untyped entries get the node's DataType if it is known and a writable
+ * built-in type, else a type following the Ruby class of the value. */
+static int entryWritableType(struct OpcuaClientContext *ctx, VALUE v_entry) {
+    long entryLen = RARRAY_LEN(v_entry);
+    VALUE v_value = rb_ary_entry(v_entry, entryLen - 1);
+
+    if (entryLen == 3) {
+        return writableTypeFromSymbol(rb_ary_entry(v_entry, 1));
+    }
+
+    struct NodeType nodeType;
+
+    if (findNodeType(ctx, rubyNodeId(rb_ary_entry(v_entry, 0)), &nodeType)) {
+        int isArray = RB_TYPE_P(v_value, T_ARRAY);
+
+        if ((isArray && nodeType.valueRank == UA_VALUERANK_SCALAR) ||
+            (!isArray && nodeType.valueRank >= UA_VALUERANK_ONE_OR_MORE_DIMENSIONS)) {
+            rb_raise(cError, "UA type mismatch");
+        }
+
+        if (nodeType.writableType >= 0) {
+            return nodeType.writableType;
+        }
+    }
+
+    if (RB_TYPE_P(v_value, T_ARRAY)) {
+        return RARRAY_LEN(v_value) > 0 ? writableTypeFromValue(rb_ary_entry(v_value, 0)) : -1;
+    }
+
+    return writableTypeFromValue(v_value);
+}
+
+/* The nodes and staged values of multi_write entries */
+struct WriteEntries {
+    long count;
+    UA_NodeId *nodes;
+    UA_Variant *values;
+    VALUE v_buffer;
+    VALUE v_entries; /* copies of the entries and values, keep them referenced */
+    VALUE v_nodes;
+};
+
+/* A copy of an entry value that Ruby code running while the entries are
+ * staged (conversions, other threads while waiting for the client) cannot
+ * resize: the staging buffer is sized before it is filled. */
+static VALUE stagingSnapshot(VALUE v_value) {
+    if (RB_TYPE_P(v_value, T_STRING)) {
+        return rb_str_new_frozen(v_value);
+    }
+
+    if (RB_TYPE_P(v_value, T_ARRAY)) {
+        VALUE v_array = rb_ary_dup(v_value);
+
+        for (long i=0; i<RARRAY_LEN(v_array); i++) {
+            VALUE v_element = RARRAY_AREF(v_array, i);
+            if (RB_TYPE_P(v_element, T_STRING)) {
+                rb_ary_store(v_array, i, rb_str_new_frozen(v_element));
+            }
+        }
+
+        return v_array;
+    }
+
+    return v_value;
+}
+
+/* Checks and stages entries of [NodeId, Symbol type, value] or [NodeId, value].
+ * Raises before anything is allocated that the GC would not free. */
+static void stageWriteEntries(UA_Client *client, VALUE v_aryEntries, struct WriteEntries *entries) {
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    Check_Type(v_aryEntries, T_ARRAY);
+
+    VALUE v_entries = rb_ary_dup(v_aryEntries);
+    const long count = RARRAY_LEN(v_entries);
+    VALUE v_nodes = rb_ary_new_capa(count);
+    size_t bufferSize = count * sizeof(UA_Variant);
+
+    entries->v_entries = v_entries;
+    entries->v_nodes = v_nodes;
+    entries->count = count;
+
+    for (long i=0; i<count; i++) {
+        VALUE v_entry = rb_ary_entry(v_entries, i);
+
+        if (RB_TYPE_P(v_entry, T_ARRAY) != 1 || (RARRAY_LEN(v_entry) != 2 && RARRAY_LEN(v_entry) != 3)) {
+            raise_invalid_arguments_error();
+        }
+
+        VALUE v_node = rb_ary_entry(v_entry, 0);
+        if (!rb_typeddata_is_kind_of(v_node, &NodeId_Type)) {
+            raise_invalid_arguments_error();
+        }
+        rb_ary_push(v_nodes, v_node);
+
+        v_entry = rb_ary_dup(v_entry);
+        rb_ary_store(v_entry, RARRAY_LEN(v_entry) - 1, stagingSnapshot(rb_ary_entry(v_entry, RARRAY_LEN(v_entry) - 1)));
+        rb_ary_store(v_entries, i, v_entry);
+    }
+
+    resolveNodeTypes(client, v_entries);
+
+    /* The cached node types may change before the second pass */
+    VALUE v_types;
+    int *types = ALLOCV_N(int, v_types, count);
+
+    for (long i=0; i<count; i++) {
+        VALUE v_entry = rb_ary_entry(v_entries, i);
+        VALUE v_value = rb_ary_entry(v_entry, RARRAY_LEN(v_entry) - 1);
+
+        int writableType = entryWritableType(ctx, v_entry);
+        if (writableType < 0) {
+            rb_raise(cError, "Unsupported type");
+        }
+        types[i] = writableType;
+        bufferSize += RB_TYPE_P(v_value, T_ARRAY) ? stagedArraySize(writableType, v_value) : stagedSize(writableType, v_value);
+    }
+
+    UA_Variant *values = rb_alloc_tmp_buffer(&entries->v_buffer, bufferSize);
+    UA_Byte *buffer = (UA_Byte *)&values[count];
+
+    for (long i=0; i<count; i++) {
+        VALUE v_entry = rb_ary_entry(v_entries, i);
+        VALUE v_value = rb_ary_entry(v_entry, RARRAY_LEN(v_entry) - 1);
+
+        if (RB_TYPE_P(v_value, T_ARRAY)) {
+            stageArray(&values[i], types[i], v_value, &buffer);
+        } else {
+            stageValue(&values[i], types[i], v_value, &buffer);
+        }
+    }
+
+    ALLOCV_END(v_types);
+    entries->values = values;
+    entries->nodes = newNodeIdsFromRuby(v_nodes);
+}
+
+static void freeWriteEntries(struct WriteEntries *entries) {
+    UA_free(entries->nodes);
+    rb_free_tmp_buffer(&entries->v_buffer);
+}
+
+/* multi_write(Array entries), each entry being [NodeId, Symbol type, value]
+ * or [NodeId, value]. Everything goes out in one WriteRequest. */
+static VALUE rb_writeValues(VALUE self, VALUE v_aryEntries) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    struct WriteEntries entries;
+    stageWriteEntries(client, v_aryEntries, &entries);
+
+    struct MultiCall call = { client, entries.nodes, entries.values, entries.count, 0 };
+    callWithoutGvl(ctx, multiWriteWithoutGvl, &call);
+
+    freeWriteEntries(&entries);
+    RB_GC_GUARD(entries.v_entries);
+    RB_GC_GUARD(entries.v_nodes);
+
+    /* Some node changed its DataType */
+    if (call.status == UA_STATUSCODE_BADTYPEMISMATCH && tryLockClient(ctx)) {
+        nodeMapClear(&ctx->nodeTypes, NULL);
+        unlockClient(ctx);
+    }
+
+    raisePendingInterrupts(ctx);
+
+    if (call.status != UA_STATUSCODE_GOOD) {
+        return raise_ua_status_error(call.status);
+    }
+
+    return Qnil;
+}
+
+/* Item results that another attempt cannot change */
+static const UA_StatusCode permanentWriteErrors[] = {
+    UA_STATUSCODE_BADNODEIDUNKNOWN,
+    UA_STATUSCODE_BADNODEIDINVALID,
+    UA_STATUSCODE_BADATTRIBUTEIDINVALID,
+    UA_STATUSCODE_BADTYPEMISMATCH,
+    UA_STATUSCODE_BADNOTWRITABLE,
+    UA_STATUSCODE_BADUSERACCESSDENIED,
+    UA_STATUSCODE_BADOUTOFRANGE,
+    UA_STATUSCODE_BADWRITENOTSUPPORTED,
+    UA_STATUSCODE_BADINDEXRANGEINVALID,
+};
+
+static int retryableWriteError(UA_StatusCode status) {
+    if (status == UA_STATUSCODE_GOOD) {
+        return 0;
+    }
+
+    for (size_t i=0; i<sizeof(permanentWriteErrors) / sizeof(permanentWriteErrors[0]); i++) {
+        if (status == permanentWriteErrors[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+struct WriteWithStatusCall {
+    UA_Client *client;
+    const UA_NodeId *nodes;
+    const UA_Variant *values;
+    long count;
+    UA_StatusCode *statuses;
+};
+
+static void *multiWriteWithStatusWithoutGvl(void *ptr) {
+    struct WriteWithStatusCall *call = ptr;
+    multiWriteWithStatus(call->client, call->nodes, call->values, call->count, call->statuses);
+    return NULL;
+}
+
+struct WriteWithStatus {
+    UA_Client *client;
+    struct WriteEntries entries;
+    unsigned int retries;
+    unsigned int backoff;
+    VALUE v_buffer;
+};
+
+static VALUE writeWithStatusAndRetries(VALUE ptr) {
+    struct WriteWithStatus *w = (struct WriteWithStatus *)ptr;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(w->client);
+    const long count = w->entries.count;
+
+    /* statuses, then the statuses, nodes and values of the items to retry */
+    UA_StatusCode *statuses = ALLOCV(w->v_buffer, count * (2 * sizeof(UA_StatusCode) + sizeof(UA_NodeId) + sizeof(UA_Variant) + sizeof(long)));
+    UA_StatusCode *retryStatuses = &statuses[count];
+    UA_NodeId *retryNodes = (UA_NodeId *)&retryStatuses[count];
+    UA_Variant *retryValues = (UA_Variant *)&retryNodes[count];
+    long *retryIndices = (long *)&retryValues[count];
+
+    struct WriteWithStatusCall call = { w->client, w->entries.nodes, w->entries.values, count, statuses };
+    callWithoutGvl(ctx, multiWriteWithStatusWithoutGvl, &call);
+    raisePendingInterrupts(ctx);
+
+    for (unsigned int attempt = 0; attempt < w->retries; attempt++) {
+        long retryCount = 0;
+
+        for (long i=0; i<count; i++) {
+            if (retryableWriteError(statuses[i])) {
+                retryNodes[retryCount] = w->entries.nodes[i];
+                retryValues[retryCount] = w->entries.values[i];
+                retryIndices[retryCount++] = i;
+            }
+        }
+
+        if (retryCount == 0) {
+            break;
+        }
+
+        double delay = (double)w->backoff * (1u << (attempt < 16 ? attempt : 16));
+        rb_thread_wait_for(rb_time_interval(DBL2NUM(delay / 1000.0)));
+
+        struct WriteWithStatusCall retryCall = { w->client, retryNodes, retryValues, retryCount, retryStatuses };
+        callWithoutGvl(ctx, multiWriteWithStatusWithoutGvl, &retryCall);
+        raisePendingInterrupts(ctx);
+
+        for (long k=0; k<retryCount; k++) {
+            statuses[retryIndices[k]] = retryStatuses[k];
+        }
+    }
+
+    VALUE v_statuses = rb_ary_new_capa(count);
+    for (long i=0; i<count; i++) {
+        rb_ary_push(v_statuses, UINT2NUM(statuses[i]));
+    }
+
+    return v_statuses;
+}
+
+static VALUE freeWriteWithStatus(VALUE ptr) {
+    struct WriteWithStatus *w = (struct WriteWithStatus *)ptr;
+    ALLOCV_END(w->v_buffer);
+    freeWriteEntries(&w->entries);
+    return Qnil;
+}
+
+/* multi_write_with_status(entries, retries: 0, backoff_ms: 100) returns one
+ * status per entry instead of raising. Items that failed with a status that
+ * may be temporary are sent again, up to retries times, waiting backoff_ms
+ * before the first retry and twice as long before each next one. */
+static VALUE rb_writeValuesWithStatus(int argc, VALUE *argv, VALUE self) {
+    VALUE v_aryEntries, v_opts;
+    rb_scan_args(argc, argv, "1:", &v_aryEntries, &v_opts);
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+
+    struct WriteWithStatus w = { uclient->client };
+    w.retries = 0;
+    w.backoff = 100;
+    w.v_buffer = 0;
+
+    if (!NIL_P(v_opts)) {
+        ID kwargs[2] = { rb_intern("retries"), rb_intern("backoff_ms") };
+        VALUE v_kwargs[2];
+        rb_get_kwargs(v_opts, kwargs, 0, 2, v_kwargs);
+
+        if (v_kwargs[0] != Qundef) {
+            w.retries = NUM2UINT(v_kwargs[0]);
+        }
+        if (v_kwargs[1] != Qundef) {
+            w.backoff = NUM2UINT(v_kwargs[1]);
+        }
+    }
+
+    stageWriteEntries(w.client, v_aryEntries, &w.entries);
+
+    VALUE v_statuses = rb_ensure(writeWithStatusAndRetries, (VALUE)&w, freeWriteWithStatus, (VALUE)&w);
+
+    RB_GC_GUARD(w.entries.v_entries);
+    RB_GC_GUARD(w.entries.v_nodes);
+
+    return v_statuses;
+}
+
+/* change_queue_capacity = n makes data changes wait in a ring buffer of n
+ * entries for drain_changes instead of calling after_data_changed(_batch).
+ * 0 turns the queue off and drops what it holds. */
+static VALUE rb_setChangeQueueCapacity(VALUE self, VALUE v_capacity) {
+    long capacity = NUM2LONG(v_capacity);
+    if (capacity < 0 || (unsigned long)capacity > SIZE_MAX / sizeof(struct QueuedChange)) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    struct QueuedChange *queue = NULL;
+    if (capacity > 0) {
+        queue = UA_malloc(capacity * sizeof(struct QueuedChange));
+        if (!queue) {
+            rb_raise(rb_eNoMemError, "failed to allocate the change queue");
+        }
+    }
+
+    rb_nativethread_lock_lock(&ctx->changeQueueLock);
+
+    struct QueuedChange *oldQueue = ctx->changeQueue;
+    size_t oldCapacity = ctx->changeQueueCapacity;
+    size_t oldHead = ctx->changeQueueHead;
+    size_t oldSize = ctx->changeQueueSize;
+
+    ctx->changeQueue = queue;
+    ctx->changeQueueCapacity = capacity;
+    ctx->changeQueueHead = 0;
+    ctx->changeQueueSize = 0;
+
+    /* Keep the newest entries that fit */
+    for (size_t i=0; i<oldSize; i++) {
+        struct QueuedChange *change = &oldQueue[(oldHead + i) % oldCapacity];
+
+        if (oldSize - i > (size_t)capacity) {
+            freeQueuedChange(change);
+            ctx->droppedChanges++;
+        } else {
+            queue[ctx->changeQueueSize++] = *change;
+        }
+    }
+
+    rb_nativethread_lock_unlock(&ctx->changeQueueLock);
+
+    UA_free(oldQueue);
+    return v_capacity;
+}
+
+static VALUE rb_changeQueueCapacity(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    return SIZET2NUM(ctx->changeQueueCapacity);
+}
+
+/* Returns [queued, dropped], dropped counting the entries overwritten so far */
+static VALUE rb_changeQueueStats(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    rb_nativethread_lock_lock(&ctx->changeQueueLock);
+    size_t queued = ctx->changeQueueSize;
+    size_t dropped = ctx->droppedChanges;
+    rb_nativethread_lock_unlock(&ctx->changeQueueLock);
+
+    return rb_assoc_new(SIZET2NUM(queued), SIZET2NUM(dropped));
+}
+
+struct DrainedChanges {
+    struct QueuedChange *changes;
+    size_t count;
+    size_t converted; /* entries whose variant was handed to Ruby and freed */
+};
+
+static VALUE drainedChangesToRuby(VALUE ptr) {
+    struct DrainedChanges *drained = (struct DrainedChanges *)ptr;
+    size_t count = drained->count;
+
+    VALUE v_monIds = rb_str_new(NULL, count * sizeof(UA_UInt32));
+    VALUE v_statuses = rb_str_new(NULL, count * sizeof(UA_StatusCode));
+    VALUE v_serverTimes = rb_str_new(NULL, count * sizeof(int64_t));
+    VALUE v_sourceTimes = rb_str_new(NULL, count * sizeof(int64_t));
+    VALUE v_values = rb_ary_new_capa(count);
+
+    UA_UInt32 *monIds = (UA_UInt32 *)RSTRING_PTR(v_monIds);
+    UA_StatusCode *statuses = (UA_StatusCode *)RSTRING_PTR(v_statuses);
+    int64_t *serverTimes = (int64_t *)RSTRING_PTR(v_serverTimes);
+    int64_t *sourceTimes = (int64_t *)RSTRING_PTR(v_sourceTimes);
+
+    for (size_t i=0; i<count; i++) {
+        struct QueuedChange *change = &drained->changes[i];
+
+        monIds[i] = change->monId;
+        statuses[i] = change->status;
+        serverTimes[i] = 0;
+        sourceTimes[i] = 0;
+        if (change->serverTime) {
+            toEpochNs(change->serverTime, &serverTimes[i]);
+        }
+        if (change->sourceTime) {
+            toEpochNs(change->sourceTime, &sourceTimes[i]);
         }
+
+        if (change->inlineType) {
+            rb_ary_push(v_values, toRubyScalar(change->inlineType, change->inlineValue.bytes));
+        } else {
+            rb_ary_push(v_values, toRubyValue(&change->variant));
+            UA_Variant_deleteMembers(&change->variant);
+        }
+
+        drained->converted = i + 1;
+    }
+
+    return rb_ary_new_from_args(5, v_monIds, v_statuses, v_serverTimes, v_sourceTimes, v_values);
+}
+
+static VALUE freeDrainedChanges(VALUE ptr) {
+    struct DrainedChanges *drained = (struct DrainedChanges *)ptr;
+
+    for (size_t i=drained->converted; i<drained->count; i++) {
+        freeQueuedChange(&drained->changes[i]);
+    }
+
+    return Qnil;
+}
+
+/* drain_changes(max = nil) takes up to max entries, oldest first, out of the
+ * change queue. Returns [mon_ids, statuses, server_times, source_times,
+ * values]: packed native UInt32 ("L*") ids and statuses, packed Int64 ("q*")
+ * times in ns since the Unix epoch (0 if missing, clamped to the Int64 range)
+ * and an Array of values. */
+static VALUE rb_drainChanges(int argc, VALUE *argv, VALUE self) {
+    VALUE v_max;
+    rb_scan_args(argc, argv, "01", &v_max);
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    long max = NIL_P(v_max) ? LONG_MAX : NUM2LONG(v_max);
+    if (max < 0) {
+        return raise_invalid_arguments_error();
+    }
+
+    /* Sized for the entries queued now, allocated before taking the lock
+     * again. Entries queued meanwhile are left for the next drain. */
+    rb_nativethread_lock_lock(&ctx->changeQueueLock);
+    size_t queued = ctx->changeQueueSize;
+    rb_nativethread_lock_unlock(&ctx->changeQueueLock);
+
+    size_t bufferSize = (size_t)max < queued ? (size_t)max : queued;
+
+    if (bufferSize == 0) {
+        struct DrainedChanges none = { NULL, 0, 0 };
+        return drainedChangesToRuby((VALUE)&none);
+    }
+
+    VALUE v_buffer;
+    struct DrainedChanges drained = { ALLOCV_N(struct QueuedChange, v_buffer, bufferSize), 0, 0 };
+
+    rb_nativethread_lock_lock(&ctx->changeQueueLock);
+
+    /* Another drain may have taken some meanwhile */
+    size_t count = ctx->changeQueueSize < bufferSize ? ctx->changeQueueSize : bufferSize;
+
+    for (size_t i=0; i<count; i++) {
+        drained.changes[i] = ctx->changeQueue[ctx->changeQueueHead];
+        ctx->changeQueueHead = (ctx->changeQueueHead + 1) % ctx->changeQueueCapacity;
+        ctx->changeQueueSize--;
+    }
+    drained.count = count;
+
+    rb_nativethread_lock_unlock(&ctx->changeQueueLock);
+
+    VALUE result = rb_ensure(drainedChangesToRuby, (VALUE)&drained, freeDrainedChanges, (VALUE)&drained);
+    ALLOCV_END(v_buffer);
+
+    return result;
+}
+
+/* timestamp_format = :time or :epoch_ns, for the server and source times of
+ * data change callbacks and reads with status */
+static VALUE rb_setTimestampFormat(VALUE self, VALUE v_format) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    if (v_format == ID2SYM(rb_intern("time"))) {
+        ctx->epochNsTimestamps = 0;
+    } else if (v_format == ID2SYM(rb_intern("epoch_ns"))) {
+        ctx->epochNsTimestamps = 1;
     } else {
-        // printf("%s\n", "multiWrite: bad write");
+        return raise_invalid_arguments_error();
+    }
+
+    return v_format;
+}
+
+static VALUE rb_timestampFormat(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    return ID2SYM(rb_intern(ctx->epochNsTimestamps ? "epoch_ns" : "time"));
+}
+
+static VALUE rb_setWriteIfChanged(VALUE self, VALUE v_enabled) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    /* A write running on another thread may be using the shadow */
+    lockClient(ctx);
+    ctx->writeIfChanged = RTEST(v_enabled);
+    if (!ctx->writeIfChanged) {
+        nodeMapClear(&ctx->writeShadow, freeShadowValue);
+    }
+    unlockClient(ctx);
+
+    return v_enabled;
+}
+
+static VALUE rb_writeIfChanged(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    return ctx->writeIfChanged ? Qtrue : Qfalse;
+}
+
+/* {written: items sent, skipped: items left out by write_if_changed} */
+static VALUE rb_writeStats(VALUE self) {
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
+
+    lockClient(ctx);
+    size_t written = ctx->writtenItems;
+    size_t skipped = ctx->skippedItems;
+    unlockClient(ctx);
+
+    VALUE v_stats = rb_hash_new();
+    rb_hash_aset(v_stats, ID2SYM(rb_intern("written")), SIZET2NUM(written));
+    rb_hash_aset(v_stats, ID2SYM(rb_intern("skipped")), SIZET2NUM(skipped));
+    return v_stats;
+}
+
+/* Completion of an asynchronous request, possibly sent in several slices.
+ * Shared by the Future and the service callbacks: whichever of them is done
+ * last frees it. */
+struct AsyncRequest {
+    VALUE future; /* Qnil once the Future was garbage collected */
+    size_t remaining; /* slices still waiting for their response, plus one while sending */
+    UA_StatusCode status; /* first bad status of any slice */
+    int done;
+};
+
+struct Future {
+    struct AsyncRequest *request;
+    VALUE client;
+    VALUE callback;
+};
+
+static void Future_mark(void *ptr) {
+    struct Future *future = ptr;
+    rb_gc_mark(future->client);
+    rb_gc_mark(future->callback);
+}
+
+static void Future_free(void *ptr) {
+    struct Future *future = ptr;
+
+    if (future->request->done) {
+        xfree(future->request);
+    } else {
+        future->request->future = Qnil;
+    }
+
+    xfree(future);
+}
+
+static const rb_data_type_t Future_Type = {
+    "OPCUAClient::Future",
+    { Future_mark, Future_free, 0 },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE newFuture(VALUE client, VALUE callback) {
+    struct Future *future = ALLOC(struct Future);
+    future->request = ALLOC(struct AsyncRequest);
+    *future->request = (const struct AsyncRequest){ 0 };
+    future->client = client;
+    future->callback = callback;
+
+    VALUE v_future = TypedData_Wrap_Struct(cFuture, &Future_Type, future);
+    future->request->future = v_future;
+    return v_future;
+}
+
+/* Futures waiting for responses, referenced from the client so that they
+ * are not collected while their requests are out */
+static VALUE pendingFutures(VALUE client) {
+    ID id = rb_intern("@pending_futures");
+    VALUE v_pending = rb_ivar_get(client, id);
+
+    if (NIL_P(v_pending)) {
+        v_pending = rb_hash_new();
+        rb_ivar_set(client, id, v_pending);
+    }
+
+    return v_pending;
+}
+
+static VALUE futureSettledWithGvl(VALUE ptr) {
+    struct AsyncRequest *request = (struct AsyncRequest *)ptr;
+    VALUE v_future = request->future;
+    struct Future *future = RTYPEDDATA_DATA(v_future);
+
+    rb_hash_delete(pendingFutures(future->client), v_future);
+
+    if (!NIL_P(future->callback)) {
+        rb_proc_call(future->callback, rb_ary_new_from_args(1, UINT2NUM(request->status)));
+    }
+
+    return Qnil;
+}
+
+static void asyncRequestDone(UA_Client *client, struct AsyncRequest *request, UA_StatusCode status) {
+    if (status != UA_STATUSCODE_GOOD && request->status == UA_STATUSCODE_GOOD) {
+        request->status = status;
+    }
+
+    if (--request->remaining > 0) {
+        return;
+    }
+
+    request->done = 1;
+
+    if (NIL_P(request->future)) {
+        xfree(request);
+        return;
+    }
+
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    if (!ctx->deleting) {
+        runRubyCallback(ctx, futureSettledWithGvl, request);
+    }
+}
+
+static void
+asyncWriteDone(UA_Client *client, void *userdata, UA_UInt32 requestId, void *response, const UA_DataType *responseType) {
+    UA_WriteResponse *wResp = response;
+    UA_StatusCode status = wResp->responseHeader.serviceResult;
+
+    for (size_t i=0; status == UA_STATUSCODE_GOOD && i<wResp->resultsSize; i++) {
+        status = wResp->results[i];
+    }
+
+    asyncRequestDone(client, userdata, status);
+}
+
+struct AsyncWriteCall {
+    UA_Client *client;
+    const UA_NodeId *nodes;
+    const UA_Variant *values;
+    long count;
+    struct AsyncRequest *request;
+};
+
+/* Sends the write in slices of at most MaxNodesPerWrite, and no larger than
+ * the server accepts, without waiting for the responses. The WriteValues are
+ * encoded right away, so they can be freed after this returns. */
+static void *sendAsyncWriteWithoutGvl(void *ptr) {
+    struct AsyncWriteCall *call = ptr;
+    size_t count = (size_t)call->count;
+    struct AsyncRequest *request = call->request;
+
+    /* Held by the sender until every slice is out, so that an early response
+     * cannot settle the request */
+    request->remaining = 1;
+
+    if (count == 0 || UA_Client_getState(call->client) < UA_CLIENTSTATE_SESSION) {
+        asyncRequestDone(call->client, request,
+            count == 0 ? UA_STATUSCODE_BADNOTHINGTODO : UA_STATUSCODE_BADSERVERNOTCONNECTED);
+        return NULL;
+    }
+
+    size_t maxItems = maxNodesPerRequest(call->client, &writeService);
+    size_t maxBytes = maxRequestItemsBytes(call->client);
+
+    UA_WriteValue *wValues = UA_calloc(count, sizeof(UA_WriteValue));
+    UA_StatusCode status = wValues ? UA_STATUSCODE_GOOD : UA_STATUSCODE_BADOUTOFMEMORY;
+
+    for (size_t i=0; wValues && i<count; i++) {
+        wValues[i].attributeId = UA_ATTRIBUTEID_VALUE;
+        wValues[i].nodeId = call->nodes[i];
+        wValues[i].value.value = call->values[i];
+        wValues[i].value.hasValue = true;
     }
 
-    UA_WriteResponse_deleteMembers(&wResp);
-    UA_free(wValues);
+    for (size_t offset=0; offset < count && status == UA_STATUSCODE_GOOD;) {
+        size_t sliceCount = sliceItemsCount(&writeService, wValues, offset, count, maxItems, maxBytes);
 
-    return retval;
-}
+        UA_WriteRequest wReq;
+        UA_WriteRequest_init(&wReq);
+        wReq.nodesToWrite = wValues + offset;
+        wReq.nodesToWriteSize = sliceCount;
 
-static VALUE rb_readUaValues(VALUE self, VALUE v_nsIndex, VALUE v_aryNames) {
-    if (RB_TYPE_P(v_nsIndex, T_FIXNUM) != 1) {
-        return raise_invalid_arguments_error();
+        /* A send that fails after the call was queued has already called
+         * asyncWriteDone, one that failed before has not */
+        request->remaining++;
+        size_t remaining = request->remaining;
+        status = __UA_Client_AsyncService(call->client, &wReq, &UA_TYPES[UA_TYPES_WRITEREQUEST],
+            asyncWriteDone, &UA_TYPES[UA_TYPES_WRITERESPONSE], request, NULL);
+
+        if (status != UA_STATUSCODE_GOOD && request->remaining == remaining) {
+            asyncRequestDone(call->client, request, status);
+        }
+
+        offset += sliceCount;
     }
 
-    Check_Type(v_aryNames, T_ARRAY);
-    const long namesCount = RARRAY_LEN(v_aryNames);
+    UA_free(wValues);
+    asyncRequestDone(call->client, request, status);
+    return NULL;
+}
 
-    int nsIndex = FIX2INT(v_nsIndex);
+/* Like multi_write, but returns an OPCUAClient::Future right after sending.
+ * The block, if any, is called with the status once the response arrived. */
+static VALUE rb_writeValuesAsync(VALUE self, VALUE v_aryEntries) {
+    VALUE v_callback = rb_block_given_p() ? rb_block_proc() : Qnil;
 
     struct UninitializedClient * uclient;
     TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
     UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
 
-    UA_UInt16 nidSize = UA_TYPES[UA_TYPES_NODEID].memSize;
-    UA_UInt16 variantSize = UA_TYPES[UA_TYPES_VARIANT].memSize;
+    struct WriteEntries entries;
+    stageWriteEntries(client, v_aryEntries, &entries);
 
-    UA_NodeId *nodes = UA_calloc(namesCount, nidSize);
-    UA_Variant *readValues = UA_calloc(namesCount, variantSize);
+    VALUE v_future = newFuture(self, v_callback);
+    struct Future *future = RTYPEDDATA_DATA(v_future);
+    rb_hash_aset(pendingFutures(self), v_future, Qtrue);
 
-    for (int i=0; i<namesCount; i++) {
-        VALUE v_name = rb_ary_entry(v_aryNames, i);
+    struct AsyncWriteCall call = { client, entries.nodes, entries.values, entries.count, future->request };
+    callWithoutGvl(ctx, sendAsyncWriteWithoutGvl, &call);
 
-        if (RB_TYPE_P(v_name, T_STRING) != 1) {
-            return raise_invalid_arguments_error();
+    freeWriteEntries(&entries);
+    RB_GC_GUARD(entries.v_entries);
+    RB_GC_GUARD(entries.v_nodes);
+
+    raisePendingInterrupts(ctx);
+    return v_future;
+}
+
+struct FutureWaitCall {
+    UA_Client *client;
+    struct OpcuaClientContext *ctx;
+    struct AsyncRequest *request;
+    UA_DateTime maxDate;
+};
+
+/* Processes responses until the request is done. A timeout closes the
+ * connection, like a timed out synchronous service, and fails every request
+ * still waiting on it. */
+static void *waitFutureWithoutGvl(void *ptr) {
+    struct FutureWaitCall *call = ptr;
+    UA_DateTime maxDate = call->maxDate;
+
+    while (!call->request->done && !blockingCallInterrupted()) {
+        if (UA_Client_getState(call->client) < UA_CLIENTSTATE_SESSION) {
+            UA_Client_AsyncService_removeAll(call->client, UA_STATUSCODE_BADCONNECTIONCLOSED);
+            break;
         }
 
-        char *name = StringValueCStr(v_name);
-        nodes[i] = UA_NODEID_STRING(nsIndex, name);
-    }
+        UA_DateTime now = UA_DateTime_nowMonotonic();
+        if (now >= maxDate) {
+            UA_Client_close(call->client);
+            UA_Client_AsyncService_removeAll(call->client, UA_STATUSCODE_BADTIMEOUT);
+            break;
+        }
 
-    UA_StatusCode status = multiRead(client, nodes, readValues, namesCount);
+        UA_UInt32 timeout = (UA_UInt32)((maxDate - now + UA_DATETIME_MSEC - 1) / UA_DATETIME_MSEC);
+        UA_StatusCode status = UA_Client_receiveAsyncResponse(call->client, timeout);
 
-    VALUE resultArray = Qnil;
+        if (status != UA_STATUSCODE_GOOD && status != UA_STATUSCODE_GOODNONCRITICALTIMEOUT) {
+            UA_Client_AsyncService_removeAll(call->client, status);
+            break;
+        }
+    }
 
-    if (status == UA_STATUSCODE_GOOD) {
-        // printf("%s\n", "value read successful");
+    return NULL;
+}
 
-        resultArray = rb_ary_new2(namesCount);
+/* Waits for the response, returns nil or raises OPCUAClient::Error */
+static VALUE rb_futureWait(VALUE self) {
+    struct Future *future;
+    TypedData_Get_Struct(self, struct Future, &Future_Type, future);
 
-        for (int i=0; i<namesCount; i++) {
-            // printf("the value is: %i\n", val);
+    if (!future->request->done) {
+        struct UninitializedClient * uclient;
+        TypedData_Get_Struct(future->client, struct UninitializedClient, &UA_Client_Type, uclient);
+        struct OpcuaClientContext *ctx = UA_Client_getContext(uclient->client);
 
-            VALUE rubyVal = Qnil;
-
-            if (UA_Variant_hasScalarType(&readValues[i], &UA_TYPES[UA_TYPES_INT16])) {
-                UA_Int16 val = *(UA_Int16*)readValues[i].data;
-                rubyVal = INT2FIX(val);
-            } else if (UA_Variant_hasScalarType(&readValues[i], &UA_TYPES[UA_TYPES_UINT16])) {
-                UA_UInt16 val = *(UA_UInt16*)readValues[i].data;
-                rubyVal = INT2FIX(val);
-            } else if (UA_Variant_hasScalarType(&readValues[i], &UA_TYPES[UA_TYPES_INT32])) {
-                 UA_Int32 val = *(UA_Int32*)readValues[i].data;
-                 rubyVal = INT2FIX(val);
-            } else if (UA_Variant_hasScalarType(&readValues[i], &UA_TYPES[UA_TYPES_UINT32])) {
-                 UA_UInt32 val = *(UA_UInt32*)readValues[i].data;
-                 rubyVal = INT2FIX(val);
-            } else if (UA_Variant_hasScalarType(&readValues[i], &UA_TYPES[UA_TYPES_BOOLEAN])) {
-                 UA_Boolean val = *(UA_Boolean*)readValues[i].data;
-                 rubyVal = val ? Qtrue : Qfalse;
-            } else if (UA_Variant_hasScalarType(&readValues[i], &UA_TYPES[UA_TYPES_FLOAT])) {
-                 UA_Float val = *(UA_Float*)readValues[i].data;
-                 rubyVal = DBL2NUM(val);
-            } else {
-                rubyVal = Qnil; // unsupported
-            }
+        /* A wakeup that raised nothing ends the wait early, the timeout
+         * still counts from the first one */
+        struct FutureWaitCall call = { uclient->client, ctx, future->request,
+            UA_DateTime_nowMonotonic() + ctx->requestTimeout * UA_DATETIME_MSEC };
 
-            rb_ary_push(resultArray, rubyVal);
-        }
-    } else {
-        /* Clean up */
-        for (int i=0; i<namesCount; i++) {
-            UA_Variant_deleteMembers(&readValues[i]);
+        while (!future->request->done) {
+            waitWithoutGvl(ctx, waitFutureWithoutGvl, &call);
+            raisePendingInterrupts(ctx);
         }
-        UA_free(nodes);
-        UA_free(readValues);
-
-        return raise_ua_status_error(status);
     }
 
-    /* Clean up */
-    for (int i=0; i<namesCount; i++) {
-        UA_Variant_deleteMembers(&readValues[i]);
+    /* Settled while an earlier callback's exception was pending */
+    rb_hash_delete(pendingFutures(future->client), self);
+
+    if (future->request->status != UA_STATUSCODE_GOOD) {
+        return raise_ua_status_error(future->request->status);
     }
-    UA_free(nodes);
-    UA_free(readValues);
 
-    return resultArray;
+    return Qnil;
+}
+
+static VALUE rb_futureDone(VALUE self) {
+    struct Future *future;
+    TypedData_Get_Struct(self, struct Future, &Future_Type, future);
+    return future->request->done ? Qtrue : Qfalse;
 }
 
-static VALUE rb_writeUaValues(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues, int uaType) {
-    if (RB_TYPE_P(v_nsIndex, T_FIXNUM) != 1) {
+/* nil while waiting for the response */
+static VALUE rb_futureStatus(VALUE self) {
+    struct Future *future;
+    TypedData_Get_Struct(self, struct Future, &Future_Type, future);
+    return future->request->done ? UINT2NUM(future->request->status) : Qnil;
+}
+
+static VALUE rb_writeUaValues(int argc, VALUE *argv, VALUE self, int uaType) {
+    long namesCount;
+    int nodeArgs = nodeIdsArgsCount(argc, argv, &namesCount);
+
+    if (argc != nodeArgs + 1) {
         return raise_invalid_arguments_error();
     }
 
-    Check_Type(v_aryNames, T_ARRAY);
+    VALUE v_aryNewValues = argv[nodeArgs];
     Check_Type(v_aryNewValues, T_ARRAY);
 
-    const long namesCount = RARRAY_LEN(v_aryNames);
     const long valuesCount = RARRAY_LEN(v_aryNewValues);
 
     if (namesCount != valuesCount) {
         return raise_invalid_arguments_error();
     }
 
-    int nsIndex = FIX2INT(v_nsIndex);
-
     struct UninitializedClient * uclient;
     TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
     UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
 
-    UA_UInt16 nidSize = UA_TYPES[UA_TYPES_NODEID].memSize;
-    UA_UInt16 variantSize = UA_TYPES[UA_TYPES_VARIANT].memSize;
+    int writableType = writableTypeFromIndex(uaType);
+    if (writableType < 0) {
+        rb_raise(cError, "Unsupported type");
+    }
 
-    UA_NodeId *nodes = UA_calloc(namesCount, nidSize);
-    UA_Variant *values = UA_calloc(namesCount, variantSize);
+    /* Variants followed by their values, in one buffer. Large batches are
+     * allocated once by ALLOCV, small ones live on the stack. */
+    size_t slotSize = STAGING_ALIGN(UA_TYPES[uaType].memSize);
+    VALUE v_buffer;
+    UA_Variant *values = ALLOCV(v_buffer, namesCount * (sizeof(UA_Variant) + slotSize));
+    UA_Byte *buffer = (UA_Byte *)&values[namesCount];
 
-    for (int i=0; i<namesCount; i++) {
-        VALUE v_name = rb_ary_entry(v_aryNames, i);
+    for (long i=0; i<namesCount; i++) {
         VALUE v_newValue = rb_ary_entry(v_aryNewValues, i);
 
-        if (RB_TYPE_P(v_name, T_STRING) != 1) {
-            return raise_invalid_arguments_error();
-        }
-
-        char *name = StringValueCStr(v_name);
-        nodes[i] = UA_NODEID_STRING(nsIndex, name);
-
-        if (uaType == UA_TYPES_UINT16) {
-            Check_Type(v_newValue, T_FIXNUM);
-            UA_UInt16 newValue = NUM2USHORT(v_newValue);
-            values[i].data = UA_malloc(sizeof(UA_UInt16));
-            *(UA_UInt16*)values[i].data = newValue;
-            values[i].type = &UA_TYPES[uaType];
-        } else if (uaType == UA_TYPES_INT16) {
-            Check_Type(v_newValue, T_FIXNUM);
-            UA_Int16 newValue = NUM2SHORT(v_newValue);
-            values[i].data = UA_malloc(sizeof(UA_Int16));
-            *(UA_Int16*)values[i].data = newValue;
-            values[i].type = &UA_TYPES[uaType];
-        } else if (uaType == UA_TYPES_UINT32) {
-            Check_Type(v_newValue, T_FIXNUM);
-            UA_UInt32 newValue = NUM2UINT(v_newValue);
-            values[i].data = UA_malloc(sizeof(UA_UInt32));
-            *(UA_UInt32*)values[i].data = newValue;
-            values[i].type = &UA_TYPES[uaType];
-        } else if (uaType == UA_TYPES_INT32) {
-            Check_Type(v_newValue, T_FIXNUM);
-            UA_Int32 newValue = NUM2INT(v_newValue);
-            values[i].data = UA_malloc(sizeof(UA_Int32));
-            *(UA_Int32*)values[i].data = newValue;
-            values[i].type = &UA_TYPES[uaType];
-        } else if (uaType == UA_TYPES_FLOAT) {
+        if (uaType == UA_TYPES_FLOAT) {
             Check_Type(v_newValue, T_FLOAT);
-            UA_Float newValue = NUM2DBL(v_newValue);
-            values[i].data = UA_malloc(sizeof(UA_Float));
-            *(UA_Float*)values[i].data = newValue;
-            values[i].type = &UA_TYPES[uaType];
-        } else if (uaType == UA_TYPES_BOOLEAN) {
-            if (RB_TYPE_P(v_newValue, T_TRUE) != 1 && RB_TYPE_P(v_newValue, T_FALSE) != 1) {
-                return raise_invalid_arguments_error();
-            }
-            UA_Boolean newValue = RTEST(v_newValue);
-            values[i].data = UA_malloc(sizeof(UA_Boolean));
-            *(UA_Boolean*)values[i].data = newValue;
-            values[i].type = &UA_TYPES[UA_TYPES_BOOLEAN];
-        } else {
-            rb_raise(cError, "Unsupported type");
+        } else if (uaType != UA_TYPES_BOOLEAN) {
+            Check_Type(v_newValue, T_FIXNUM);
         }
-    }
 
-    UA_StatusCode status = multiWrite(client, nodes, values, namesCount);
+        stageValue(&values[i], writableType, v_newValue, &buffer);
+    }
 
-    if (status == UA_STATUSCODE_GOOD) {
-        // printf("%s\n", "value write successful");
-    } else {
-        /* Clean up */
-        for (int i=0; i<namesCount; i++) {
-            UA_Variant_deleteMembers(&values[i]);
-        }
-        UA_free(nodes);
-        UA_free(values);
+    UA_NodeId *nodes = nodeIdsFromArgs(nodeArgs, argv);
 
-        return raise_ua_status_error(status);
-    }
+    struct MultiCall call = { client, nodes, values, namesCount, 0 };
+    callWithoutGvl(ctx, multiWriteWithoutGvl, &call);
+    UA_StatusCode status = call.status;
 
     /* Clean up */
-    for (int i=0; i<namesCount; i++) {
-        UA_Variant_deleteMembers(&values[i]);
-    }
     UA_free(nodes);
-    UA_free(values);
+    ALLOCV_END(v_buffer);
+
+    raisePendingInterrupts(ctx);
+
+    if (status != UA_STATUSCODE_GOOD) {
+        return raise_ua_status_error(status);
+    }
 
     return Qnil;
 }
 
-static VALUE rb_writeUaValue(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue, int uaType) {
-    if (RB_TYPE_P(v_name, T_STRING) != 1) {
-        return raise_invalid_arguments_error();
-    }
+struct ValueAttributeCall {
+    UA_Client *client;
+    UA_NodeId nodeId;
+    UA_Variant *value;
+    UA_StatusCode status;
+};
+
+static void *writeValueAttributeWithoutGvl(void *ptr) {
+    struct ValueAttributeCall *call = ptr;
+    call->status = UA_Client_writeValueAttribute(call->client, call->nodeId, call->value);
+    return NULL;
+}
 
-    if (RB_TYPE_P(v_nsIndex, T_FIXNUM) != 1) {
+static void *readValueAttributeWithoutGvl(void *ptr) {
+    struct ValueAttributeCall *call = ptr;
+    call->status = UA_Client_readValueAttribute(call->client, call->nodeId, call->value);
+    return NULL;
+}
+
+static VALUE rb_writeUaValue(int argc, VALUE *argv, VALUE self, int uaType) {
+    int nodeArgs = nodeIdArgsCount(argc, argv);
+
+    if (argc != nodeArgs + 1) {
         return raise_invalid_arguments_error();
     }
 
+    VALUE v_newValue = argv[nodeArgs];
+
     if (uaType == UA_TYPES_INT16 && RB_TYPE_P(v_newValue, T_FIXNUM) != 1) {
         return raise_invalid_arguments_error();
     }
 
-    char *name = StringValueCStr(v_name);
-    int nsIndex = FIX2INT(v_nsIndex);
-
     struct UninitializedClient * uclient;
     TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
     UA_Client *client = uclient->client;
 
+    int writableType = writableTypeFromIndex(uaType);
+    if (writableType < 0) {
+        rb_raise(cError, "Unsupported type");
+    }
+
+    if (uaType == UA_TYPES_BOOLEAN) {
+        v_newValue = RTEST(v_newValue) ? Qtrue : Qfalse;
+    }
+
+    /* Every fixed-size scalar fits, no heap allocation */
+    union {
+        UA_Int64 i;
+        UA_Double d;
+        UA_Byte bytes[16];
+    } storage;
+    UA_Byte *buffer = storage.bytes;
+
     UA_Variant value;
     UA_Variant_init(&value);
+    stageValue(&value, writableType, v_newValue, &buffer);
 
-    if (uaType == UA_TYPES_INT16) {
-        UA_Int16 newValue = NUM2SHORT(v_newValue);
-        value.data = UA_malloc(sizeof(UA_Int16));
-        *(UA_Int16*)value.data = newValue;
-        value.type = &UA_TYPES[UA_TYPES_INT16];
-    } else if (uaType == UA_TYPES_UINT16) {
-        UA_UInt16 newValue = NUM2USHORT(v_newValue);
-        value.data = UA_malloc(sizeof(UA_UInt16));
-        *(UA_UInt16*)value.data = newValue;
-        value.type = &UA_TYPES[UA_TYPES_UINT16];
-    } else if (uaType == UA_TYPES_INT32) {
-        UA_Int32 newValue = NUM2INT(v_newValue);
-        value.data = UA_malloc(sizeof(UA_Int32));
-        *(UA_Int32*)value.data = newValue;
-        value.type = &UA_TYPES[UA_TYPES_INT32];
-    } else if (uaType == UA_TYPES_UINT32) {
-        UA_UInt32 newValue = NUM2UINT(v_newValue);
-        value.data = UA_malloc(sizeof(UA_UInt32));
-        *(UA_UInt32*)value.data = newValue;
-        value.type = &UA_TYPES[UA_TYPES_UINT32];
-    } else if (uaType == UA_TYPES_FLOAT) {
-        UA_Float newValue = NUM2DBL(v_newValue);
-        value.data = UA_malloc(sizeof(UA_Float));
-        *(UA_Float*)value.data = newValue;
-        value.type = &UA_TYPES[UA_TYPES_FLOAT];
-    } else if (uaType == UA_TYPES_BOOLEAN) {
-        UA_Boolean newValue = RTEST(v_newValue);
-        value.data = UA_malloc(sizeof(UA_Boolean));
-        *(UA_Boolean*)value.data = newValue;
-        value.type = &UA_TYPES[UA_TYPES_BOOLEAN];
-    } else {
-        rb_raise(cError, "Unsupported type");
-    }
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+    struct ValueAttributeCall call = { client, nodeIdFromArgs(nodeArgs, argv), &value, 0 };
+    callWithoutGvl(ctx, writeValueAttributeWithoutGvl, &call);
+    UA_NodeId_deleteMembers(&call.nodeId);
+    UA_StatusCode status = call.status;
 
-    UA_StatusCode status = UA_Client_writeValueAttribute(client, UA_NODEID_STRING(nsIndex, name), &value);
+    raisePendingInterrupts(ctx);
 
-    if (status == UA_STATUSCODE_GOOD) {
-        // printf("%s\n", "value write successful");
-    } else {
-        /* Clean up */
-        UA_Variant_deleteMembers(&value);
+    if (status != UA_STATUSCODE_GOOD) {
         return raise_ua_status_error(status);
     }
 
-    /* Clean up */
-    UA_Variant_deleteMembers(&value);
-
     return Qnil;
 }
 
-static VALUE rb_writeUInt16Value(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue) {
-    return rb_writeUaValue(self, v_nsIndex, v_name, v_newValue, UA_TYPES_UINT16);
+static VALUE rb_writeUInt16Value(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValue(argc, argv, self, UA_TYPES_UINT16);
 }
 
-static VALUE rb_writeUInt16Values(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues) {
-    return rb_writeUaValues(self, v_nsIndex, v_aryNames, v_aryNewValues, UA_TYPES_UINT16);
+static VALUE rb_writeUInt16Values(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValues(argc, argv, self, UA_TYPES_UINT16);
 }
 
-static VALUE rb_writeInt16Value(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue) {
-    return rb_writeUaValue(self, v_nsIndex, v_name, v_newValue, UA_TYPES_INT16);
+static VALUE rb_writeInt16Value(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValue(argc, argv, self, UA_TYPES_INT16);
 }
 
-static VALUE rb_writeInt16Values(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues) {
-    return rb_writeUaValues(self, v_nsIndex, v_aryNames, v_aryNewValues, UA_TYPES_INT16);
+static VALUE rb_writeInt16Values(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValues(argc, argv, self, UA_TYPES_INT16);
 }
 
-static VALUE rb_writeInt32Value(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue) {
-    return rb_writeUaValue(self, v_nsIndex, v_name, v_newValue, UA_TYPES_INT32);
+static VALUE rb_writeInt32Value(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValue(argc, argv, self, UA_TYPES_INT32);
 }
 
-static VALUE rb_writeInt32Values(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues) {
-    return rb_writeUaValues(self, v_nsIndex, v_aryNames, v_aryNewValues, UA_TYPES_INT32);
+static VALUE rb_writeInt32Values(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValues(argc, argv, self, UA_TYPES_INT32);
 }
 
-static VALUE rb_writeUInt32Value(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue) {
-    return rb_writeUaValue(self, v_nsIndex, v_name, v_newValue, UA_TYPES_UINT32);
+static VALUE rb_writeUInt32Value(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValue(argc, argv, self, UA_TYPES_UINT32);
 }
 
-static VALUE rb_writeUInt32Values(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues) {
-    return rb_writeUaValues(self, v_nsIndex, v_aryNames, v_aryNewValues, UA_TYPES_UINT32);
+static VALUE rb_writeUInt32Values(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValues(argc, argv, self, UA_TYPES_UINT32);
 }
 
-static VALUE rb_writeBooleanValue(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue) {
-    return rb_writeUaValue(self, v_nsIndex, v_name, v_newValue, UA_TYPES_BOOLEAN);
+static VALUE rb_writeBooleanValue(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValue(argc, argv, self, UA_TYPES_BOOLEAN);
 }
 
-static VALUE rb_writeBooleanValues(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues) {
-    return rb_writeUaValues(self, v_nsIndex, v_aryNames, v_aryNewValues, UA_TYPES_BOOLEAN);
+static VALUE rb_writeBooleanValues(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValues(argc, argv, self, UA_TYPES_BOOLEAN);
 }
 
-static VALUE rb_writeFloatValue(VALUE self, VALUE v_nsIndex, VALUE v_name, VALUE v_newValue) {
-    return rb_writeUaValue(self, v_nsIndex, v_name, v_newValue, UA_TYPES_FLOAT);
+static VALUE rb_writeFloatValue(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValue(argc, argv, self, UA_TYPES_FLOAT);
 }
 
-static VALUE rb_writeFloatValues(VALUE self, VALUE v_nsIndex, VALUE v_aryNames, VALUE v_aryNewValues) {
-    return rb_writeUaValues(self, v_nsIndex, v_aryNames, v_aryNewValues, UA_TYPES_FLOAT);
+static VALUE rb_writeFloatValues(int argc, VALUE *argv, VALUE self) {
+    return rb_writeUaValues(argc, argv, self, UA_TYPES_FLOAT);
 }
 
-static VALUE rb_readUaValue(VALUE self, VALUE v_nsIndex, VALUE v_name, int type) {
-    if (RB_TYPE_P(v_name, T_STRING) != 1) {
-        return raise_invalid_arguments_error();
-    }
-
-    if (RB_TYPE_P(v_nsIndex, T_FIXNUM) != 1) {
+static VALUE rb_readUaValue(int argc, VALUE *argv, VALUE self, int type) {
+    if (nodeIdArgsCount(argc, argv) != argc) {
         return raise_invalid_arguments_error();
     }
 
-    char *name = StringValueCStr(v_name);
-    int nsIndex = FIX2INT(v_nsIndex);
-
     struct UninitializedClient * uclient;
     TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
     UA_Client *client = uclient->client;
 
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
     UA_Variant value;
     UA_Variant_init(&value);
-    UA_StatusCode status = UA_Client_readValueAttribute(client, UA_NODEID_STRING(nsIndex, name), &value);
+    struct ValueAttributeCall call = { client, nodeIdFromArgs(argc, argv), &value, 0 };
+    callWithoutGvl(ctx, readValueAttributeWithoutGvl, &call);
+    UA_NodeId_deleteMembers(&call.nodeId);
+    UA_StatusCode status = call.status;
 
     if (status == UA_STATUSCODE_GOOD) {
         // printf("%s\n", "value read successful");
     } else {
         /* Clean up */
         UA_Variant_deleteMembers(&value);
+        raisePendingInterrupts(ctx);
         return raise_ua_status_error(status);
     }
 
-    VALUE result = Qnil;
-
-    if (type == UA_TYPES_INT16 && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_INT16])) {
-        UA_Int16 val =*(UA_Int16*)value.data;
-        // printf("the value is: %i\n", val);
-        result = INT2FIX(val);
-    } else if (type == UA_TYPES_UINT16 && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_UINT16])) {
-        UA_UInt16 val =*(UA_UInt16*)value.data;
-        // printf("the value is: %i\n", val);
-        result = INT2FIX(val);
-    } else if (type == UA_TYPES_INT32 && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_INT32])) {
-        UA_Int32 val =*(UA_Int32*)value.data;
-        result = INT2FIX(val);
-    } else if (type == UA_TYPES_UINT32 && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_UINT32])) {
-        UA_UInt32 val =*(UA_UInt32*)value.data;
-        result = INT2FIX(val);
-    } else if (type == UA_TYPES_BOOLEAN && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_BOOLEAN])) {
-        UA_Boolean val =*(UA_Boolean*)value.data;
-        result = val ? Qtrue : Qfalse;
-    } else if (type == UA_TYPES_FLOAT && UA_Variant_hasScalarType(&value, &UA_TYPES[UA_TYPES_FLOAT])) {
-        UA_Float val =*(UA_Float*)value.data;
-        result = DBL2NUM(val);
-    } else {
+    if (type != ANY_UA_TYPE && !UA_Variant_hasScalarType(&value, &UA_TYPES[type])) {
+        UA_Variant_deleteMembers(&value);
+        raisePendingInterrupts(ctx);
         rb_raise(cError, "UA type mismatch");
         return Qnil;
     }
 
+    VALUE result = toRubyValue(&value);
+
     /* Clean up */
     UA_Variant_deleteMembers(&value);
 
+    raisePendingInterrupts(ctx);
     return result;
 }
 
-static VALUE rb_readInt16Value(VALUE self, VALUE v_nsIndex, VALUE v_name) {
-    return rb_readUaValue(self, v_nsIndex, v_name, UA_TYPES_INT16);
+static VALUE rb_readInt16Value(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, UA_TYPES_INT16);
 }
 
-static VALUE rb_readUInt16Value(VALUE self, VALUE v_nsIndex, VALUE v_name) {
-    return rb_readUaValue(self, v_nsIndex, v_name, UA_TYPES_UINT16);
+static VALUE rb_readUInt16Value(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, UA_TYPES_UINT16);
 }
 
-static VALUE rb_readInt32Value(VALUE self, VALUE v_nsIndex, VALUE v_name) {
-    return rb_readUaValue(self, v_nsIndex, v_name, UA_TYPES_INT32);
+static VALUE rb_readInt32Value(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, UA_TYPES_INT32);
+}
+
+static VALUE rb_readUInt32Value(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, UA_TYPES_UINT32);
+}
+
+static VALUE rb_readBooleanValue(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, UA_TYPES_BOOLEAN);
+}
+
+static VALUE rb_readFloatValue(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, UA_TYPES_FLOAT);
+}
+
+static VALUE rb_readValue(int argc, VALUE *argv, VALUE self) {
+    return rb_readUaValue(argc, argv, self, ANY_UA_TYPE);
+}
+
+/* Returns [Symbol type, String data] for an array of a packedArrayTypes
+ * element type, the data being the elements in native byte order. */
+static VALUE rb_readArrayWithType(int argc, VALUE *argv, VALUE self) {
+    if (nodeIdArgsCount(argc, argv) != argc) {
+        return raise_invalid_arguments_error();
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    UA_Variant value;
+    UA_Variant_init(&value);
+    struct ValueAttributeCall call = { client, nodeIdFromArgs(argc, argv), &value, 0 };
+    callWithoutGvl(ctx, readValueAttributeWithoutGvl, &call);
+    UA_NodeId_deleteMembers(&call.nodeId);
+    UA_StatusCode status = call.status;
+
+    if (status != UA_STATUSCODE_GOOD) {
+        UA_Variant_deleteMembers(&value);
+        raisePendingInterrupts(ctx);
+        return raise_ua_status_error(status);
+    }
+
+    const char *typeName = packedArrayTypeName(&value);
+
+    if (!typeName) {
+        UA_Variant_deleteMembers(&value);
+        raisePendingInterrupts(ctx);
+        rb_raise(cError, "UA type mismatch");
+        return Qnil;
+    }
+
+    VALUE result = rb_assoc_new(ID2SYM(rb_intern(typeName)), toRubyPackedArray(&value));
+
+    UA_Variant_deleteMembers(&value);
+
+    raisePendingInterrupts(ctx);
+    return result;
 }
 
-static VALUE rb_readUInt32Value(VALUE self, VALUE v_nsIndex, VALUE v_name) {
-    return rb_readUaValue(self, v_nsIndex, v_name, UA_TYPES_UINT32);
+/* A write_array call, see rb_writeArray */
+struct ArrayWrite {
+    struct OpcuaClientContext *ctx;
+    struct MultiCall call;
+    VALUE v_data;
+};
+
+static VALUE sendArrayWrite(VALUE ptr) {
+    struct ArrayWrite *write = (struct ArrayWrite *)ptr;
+    UA_Variant *value = write->call.values;
+
+    if (RSTRING_LEN(write->v_data) % value->type->memSize != 0) {
+        return raise_invalid_arguments_error();
+    }
+
+    value->arrayLength = RSTRING_LEN(write->v_data) / value->type->memSize;
+    /* An empty array still needs a non-NULL data pointer */
+    value->data = value->arrayLength > 0 ? RSTRING_PTR(write->v_data) : UA_EMPTY_ARRAY_SENTINEL;
+
+    callWithoutGvl(write->ctx, multiWriteWithoutGvl, &write->call);
+    return Qnil;
 }
 
-static VALUE rb_readBooleanValue(VALUE self, VALUE v_nsIndex, VALUE v_name) {
-    return rb_readUaValue(self, v_nsIndex, v_name, UA_TYPES_BOOLEAN);
+static VALUE releaseArrayWrite(VALUE ptr) {
+    struct ArrayWrite *write = (struct ArrayWrite *)ptr;
+
+    rb_str_unlocktmp(write->v_data);
+    UA_NodeId_deleteMembers((UA_NodeId *)write->call.nodes);
+    return Qnil;
 }
 
-static VALUE rb_readFloatValue(VALUE self, VALUE v_nsIndex, VALUE v_name) {
-    return rb_readUaValue(self, v_nsIndex, v_name, UA_TYPES_FLOAT);
+/* write_array(node, Symbol type, String data) writes data, the elements of
+ * a packedArrayTypes element type in native byte order, as an array. The
+ * variant points into the string, which is locked until the write is done. */
+static VALUE rb_writeArray(int argc, VALUE *argv, VALUE self) {
+    int nodeArgs = nodeIdArgsCount(argc, argv);
+
+    if (argc != nodeArgs + 2) {
+        return raise_invalid_arguments_error();
+    }
+
+    VALUE v_type = argv[nodeArgs];
+    VALUE v_data = argv[nodeArgs + 1];
+
+    if (!SYMBOL_P(v_type) || !RB_TYPE_P(v_data, T_STRING)) {
+        return raise_invalid_arguments_error();
+    }
+
+    const UA_DataType *type = NULL;
+    const char *typeName = rb_id2name(SYM2ID(v_type));
+
+    for (size_t i=0; i<sizeof(packedArrayTypes) / sizeof(packedArrayTypes[0]); i++) {
+        if (strcmp(typeName, packedArrayTypes[i].name) == 0) {
+            type = &UA_TYPES[packedArrayTypes[i].typeIndex];
+            break;
+        }
+    }
+
+    if (!type) {
+        rb_raise(cError, "Unsupported type");
+    }
+
+    struct UninitializedClient * uclient;
+    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
+    UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
+
+    /* Resolving the name may run Ruby code, so it goes before the lock */
+    UA_NodeId nodeId = nodeIdFromArgs(nodeArgs, argv);
+
+    UA_Variant value;
+    UA_Variant_init(&value);
+    value.type = type;
+    value.storageType = UA_VARIANT_DATA_NODELETE;
+
+    struct ArrayWrite write = { ctx, { client, &nodeId, &value, 1, 0 }, v_data };
+    rb_str_locktmp(v_data);
+    rb_ensure(sendArrayWrite, (VALUE)&write, releaseArrayWrite, (VALUE)&write);
+
+    raisePendingInterrupts(ctx);
+
+    if (write.call.status != UA_STATUSCODE_GOOD) {
+        return raise_ua_status_error(write.call.status);
+    }
+
+    return Qnil;
 }
 
 static VALUE rb_get_human_UA_StatusCode(VALUE self, VALUE v_code) {
@@ -771,21 +4712,90 @@ static VALUE rb_get_human_UA_StatusCode(VALUE self, VALUE v_code) {
     }
 }
 
-static VALUE rb_run_single_monitoring_cycle(VALUE self) {
-    struct UninitializedClient * uclient;
-    TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
-    UA_Client *client = uclient->client;
+struct MonitoringCycleCall {
+    UA_Client *client;
+    struct OpcuaClientContext *ctx;
+    UA_DateTime maxDate;
+    int gaveWay; /* stopped early to let other threads use the client */
+    UA_StatusCode status;
+};
 
-    UA_StatusCode status = UA_Client_runAsync(client, 1000);
-    return UINT2NUM(status);
+/* Runs the client in short slices until the first batch of notifications has
+ * been processed, the timeout passed or the call was interrupted. Threads
+ * waiting for the client get it between two slices, the cycle then goes on
+ * in another call. */
+static void *monitoringCycleWithoutGvl(void *ptr) {
+    struct MonitoringCycleCall *call = ptr;
+
+    /* Notifications processed by the calls of other threads count as well */
+    if (!call->gaveWay) {
+        call->ctx->dataChanges = 0;
+    }
+
+    call->gaveWay = 0;
+
+    do {
+        UA_DateTime remaining = call->maxDate - UA_DateTime_nowMonotonic();
+        UA_UInt16 slice = INTERRUPT_CHECK_INTERVAL_MS;
+
+        if (remaining < slice * UA_DATETIME_MSEC) {
+            slice = remaining > 0 ? (UA_UInt16)((remaining + UA_DATETIME_MSEC - 1) / UA_DATETIME_MSEC) : 1;
+        }
+
+        call->status = UA_Client_runAsync(call->client, slice);
+
+        if (call->status != UA_STATUSCODE_GOOD || call->ctx->dataChanges > 0 || blockingCallInterrupted()) {
+            break;
+        }
+
+        if (call->ctx->lockWaiting > 0) {
+            call->gaveWay = 1;
+            break;
+        }
+    } while (UA_DateTime_nowMonotonic() < call->maxDate);
+
+    return NULL;
 }
 
-static VALUE rb_run_single_monitoring_cycle_bang(VALUE self) {
+static UA_StatusCode runMonitoringCycle(VALUE self, int argc, VALUE *argv) {
+    VALUE v_opts;
+    rb_scan_args(argc, argv, ":", &v_opts);
+
+    UA_UInt32 timeout = DEFAULT_MONITORING_CYCLE_TIMEOUT_MS;
+
+    if (!NIL_P(v_opts)) {
+        ID kwargs[1] = { rb_intern("timeout_ms") };
+        VALUE v_timeout;
+        rb_get_kwargs(v_opts, kwargs, 0, 1, &v_timeout);
+
+        if (v_timeout != Qundef) {
+            timeout = NUM2UINT(v_timeout);
+        }
+    }
+
     struct UninitializedClient * uclient;
     TypedData_Get_Struct(self, struct UninitializedClient, &UA_Client_Type, uclient);
     UA_Client *client = uclient->client;
+    struct OpcuaClientContext *ctx = UA_Client_getContext(client);
 
-    UA_StatusCode status = UA_Client_runAsync(client, 1000);
+    UA_DateTime maxDate = UA_DateTime_nowMonotonic() + (UA_DateTime)timeout * UA_DATETIME_MSEC;
+    struct MonitoringCycleCall call = { client, ctx, maxDate, 0, UA_STATUSCODE_GOOD };
+
+    do {
+        waitWithoutGvl(ctx, monitoringCycleWithoutGvl, &call);
+        raisePendingInterrupts(ctx);
+    } while (call.gaveWay);
+
+    return call.status;
+}
+
+static VALUE rb_run_single_monitoring_cycle(int argc, VALUE *argv, VALUE self) {
+    UA_StatusCode status = runMonitoringCycle(self, argc, argv);
+    return UINT2NUM(status);
+}
+
+static VALUE rb_run_single_monitoring_cycle_bang(int argc, VALUE *argv, VALUE self) {
+    UA_StatusCode status = runMonitoringCycle(self, argc, argv);
 
     if (status != UA_STATUSCODE_GOOD) {
         return raise_ua_status_error(status);
@@ -828,48 +4838,95 @@ void Init_opcua_client()
 
     rb_define_alloc_func(cClient, allocate);
 
+    cReadPlan = rb_define_class_under(mOPCUAClient, "ReadPlan", rb_cObject);
+    rb_global_variable(&cReadPlan);
+    rb_define_alloc_func(cReadPlan, allocateReadPlan);
+    rb_define_method(cReadPlan, "initialize", rb_initializeReadPlan, -1);
+    rb_define_method(cReadPlan, "size", rb_readPlanSize, 0);
+
+    cFuture = rb_define_class_under(mOPCUAClient, "Future", rb_cObject);
+    rb_global_variable(&cFuture);
+    rb_undef_alloc_func(cFuture);
+    rb_define_method(cFuture, "wait", rb_futureWait, 0);
+    rb_define_method(cFuture, "done?", rb_futureDone, 0);
+    rb_define_method(cFuture, "status", rb_futureStatus, 0);
+
+    cNodeId = rb_define_class_under(mOPCUAClient, "NodeId", rb_cObject);
+    rb_global_variable(&cNodeId);
+    rb_define_alloc_func(cNodeId, allocateNodeId);
+    rb_define_method(cNodeId, "initialize", rb_initializeNodeId, -1);
+    rb_define_method(cNodeId, "namespace_index", rb_nodeIdNamespaceIndex, 0);
+    rb_define_method(cNodeId, "identifier_type", rb_nodeIdIdentifierType, 0);
+    rb_define_method(cNodeId, "identifier", rb_nodeIdIdentifier, 0);
+    rb_define_method(cNodeId, "==", rb_nodeIdEqual, 1);
+    rb_define_method(cNodeId, "eql?", rb_nodeIdEqual, 1);
+    rb_define_method(cNodeId, "hash", rb_nodeIdHash, 0);
+
     rb_define_method(cClient, "initialize", rb_initialize, 0);
 
-    rb_define_method(cClient, "run_single_monitoring_cycle", rb_run_single_monitoring_cycle, 0);
-    rb_define_method(cClient, "run_mon_cycle", rb_run_single_monitoring_cycle, 0);
-    rb_define_method(cClient, "do_mon_cycle", rb_run_single_monitoring_cycle, 0);
+    rb_define_method(cClient, "run_single_monitoring_cycle", rb_run_single_monitoring_cycle, -1);
+    rb_define_method(cClient, "run_mon_cycle", rb_run_single_monitoring_cycle, -1);
+    rb_define_method(cClient, "do_mon_cycle", rb_run_single_monitoring_cycle, -1);
 
-    rb_define_method(cClient, "run_single_monitoring_cycle!", rb_run_single_monitoring_cycle_bang, 0);
-    rb_define_method(cClient, "run_mon_cycle!", rb_run_single_monitoring_cycle_bang, 0);
-    rb_define_method(cClient, "do_mon_cycle!", rb_run_single_monitoring_cycle_bang, 0);
+    rb_define_method(cClient, "run_single_monitoring_cycle!", rb_run_single_monitoring_cycle_bang, -1);
+    rb_define_method(cClient, "run_mon_cycle!", rb_run_single_monitoring_cycle_bang, -1);
+    rb_define_method(cClient, "do_mon_cycle!", rb_run_single_monitoring_cycle_bang, -1);
 
     rb_define_method(cClient, "connect", rb_connect, 1);
     rb_define_method(cClient, "disconnect", rb_disconnect, 0);
     rb_define_method(cClient, "state", rb_state, 0);
 
-    rb_define_method(cClient, "read_int16", rb_readInt16Value, 2);
-    rb_define_method(cClient, "read_uint16", rb_readUInt16Value, 2);
-    rb_define_method(cClient, "read_int32", rb_readInt32Value, 2);
-    rb_define_method(cClient, "read_uint32", rb_readUInt32Value, 2);
-    rb_define_method(cClient, "read_float", rb_readFloatValue, 2);
-    rb_define_method(cClient, "read_boolean", rb_readBooleanValue, 2);
-    rb_define_method(cClient, "read_bool", rb_readBooleanValue, 2);
-
-    rb_define_method(cClient, "write_int16", rb_writeInt16Value, 3);
-    rb_define_method(cClient, "write_uint16", rb_writeUInt16Value, 3);
-    rb_define_method(cClient, "write_int32", rb_writeInt32Value, 3);
-    rb_define_method(cClient, "write_uint32", rb_writeUInt32Value, 3);
-    rb_define_method(cClient, "write_float", rb_writeFloatValue, 3);
-    rb_define_method(cClient, "write_boolean", rb_writeBooleanValue, 3);
-    rb_define_method(cClient, "write_bool", rb_writeBooleanValue, 3);
-
-    rb_define_method(cClient, "multi_write_int16", rb_writeInt16Values, 3);
-    rb_define_method(cClient, "multi_write_uint16", rb_writeUInt16Values, 3);
-    rb_define_method(cClient, "multi_write_int32", rb_writeInt32Values, 3);
-    rb_define_method(cClient, "multi_write_uint32", rb_writeUInt32Values, 3);
-    rb_define_method(cClient, "multi_write_float", rb_writeFloatValues, 3);
-    rb_define_method(cClient, "multi_write_boolean", rb_writeBooleanValues, 3);
-    rb_define_method(cClient, "multi_write_bool", rb_writeBooleanValues, 3);
-
-    rb_define_method(cClient, "multi_read", rb_readUaValues, 2);
-
-    rb_define_method(cClient, "create_subscription", rb_createSubscription, 0);
-    rb_define_method(cClient, "add_monitored_item", rb_addMonitoredItem, 3);
+    rb_define_method(cClient, "read_int16", rb_readInt16Value, -1);
+    rb_define_method(cClient, "read_uint16", rb_readUInt16Value, -1);
+    rb_define_method(cClient, "read_int32", rb_readInt32Value, -1);
+    rb_define_method(cClient, "read_uint32", rb_readUInt32Value, -1);
+    rb_define_method(cClient, "read_float", rb_readFloatValue, -1);
+    rb_define_method(cClient, "read_value", rb_readValue, -1);
+    rb_define_method(cClient, "read_boolean", rb_readBooleanValue, -1);
+    rb_define_method(cClient, "read_bool", rb_readBooleanValue, -1);
+
+    rb_define_method(cClient, "write_int16", rb_writeInt16Value, -1);
+    rb_define_method(cClient, "write_uint16", rb_writeUInt16Value, -1);
+    rb_define_method(cClient, "write_int32", rb_writeInt32Value, -1);
+    rb_define_method(cClient, "write_uint32", rb_writeUInt32Value, -1);
+    rb_define_method(cClient, "write_float", rb_writeFloatValue, -1);
+    rb_define_method(cClient, "write_boolean", rb_writeBooleanValue, -1);
+    rb_define_method(cClient, "write_bool", rb_writeBooleanValue, -1);
+
+    rb_define_method(cClient, "multi_write_int16", rb_writeInt16Values, -1);
+    rb_define_method(cClient, "multi_write_uint16", rb_writeUInt16Values, -1);
+    rb_define_method(cClient, "multi_write_int32", rb_writeInt32Values, -1);
+    rb_define_method(cClient, "multi_write_uint32", rb_writeUInt32Values, -1);
+    rb_define_method(cClient, "multi_write_float", rb_writeFloatValues, -1);
+    rb_define_method(cClient, "multi_write_boolean", rb_writeBooleanValues, -1);
+    rb_define_method(cClient, "multi_write_bool", rb_writeBooleanValues, -1);
+
+    rb_define_method(cClient, "read_array_with_type", rb_readArrayWithType, -1);
+    rb_define_method(cClient, "write_array", rb_writeArray, -1);
+
+    rb_define_method(cClient, "multi_write", rb_writeValues, 1);
+    rb_define_method(cClient, "multi_write_async", rb_writeValuesAsync, 1);
+    rb_define_method(cClient, "multi_write_with_status", rb_writeValuesWithStatus, -1);
+    rb_define_method(cClient, "write_if_changed=", rb_setWriteIfChanged, 1);
+    rb_define_method(cClient, "write_if_changed?", rb_writeIfChanged, 0);
+    rb_define_method(cClient, "write_stats", rb_writeStats, 0);
+    rb_define_method(cClient, "timestamp_format=", rb_setTimestampFormat, 1);
+    rb_define_method(cClient, "timestamp_format", rb_timestampFormat, 0);
+    rb_define_method(cClient, "multi_read", rb_readUaValues, -1);
+    rb_define_method(cClient, "multi_read_with_status", rb_readUaValuesWithStatus, -1);
+    rb_define_method(cClient, "read", rb_readWithPlan, 1);
+    rb_define_method(cClient, "read_with_status", rb_readWithPlanAndStatus, 1);
+    rb_define_method(cClient, "register_nodes", rb_registerNodes, -1);
+    rb_define_method(cClient, "unregister_nodes", rb_unregisterNodes, 1);
+
+    rb_define_method(cClient, "create_subscription", rb_createSubscription, -1);
+    rb_define_method(cClient, "add_monitored_item", rb_addMonitoredItem, -1);
+    rb_define_method(cClient, "add_monitored_items", rb_addMonitoredItems, -1);
+    rb_define_method(cClient, "after_data_changed_batch", rb_afterDataChangedBatch, 0);
+    rb_define_method(cClient, "change_queue_capacity=", rb_setChangeQueueCapacity, 1);
+    rb_define_method(cClient, "change_queue_capacity", rb_changeQueueCapacity, 0);
+    rb_define_method(cClient, "change_queue_stats", rb_changeQueueStats, 0);
+    rb_define_method(cClient, "drain_changes", rb_drainChanges, -1);
 
     rb_define_singleton_method(mOPCUAClient, "human_status_code", rb_get_human_UA_StatusCode, 1);
 }
@@ -3872,6 +3872,11 @@ UA_StatusCode
 UA_MessageContext_encode(UA_MessageContext *mc, const void *content,
                          const UA_DataType *contentType);
 
+/* Append bytes that are already binary-encoded. Behaves like
+ * UA_MessageContext_encode with respect to chunking and cleanup. */
+UA_StatusCode
+UA_MessageContext_encodeRaw(UA_MessageContext *mc, const UA_ByteString *raw);
+
 /* Sends a symmetric message already encoded in the context. The context is
  * cleaned up, also in case of errors. */
 UA_StatusCode
@@ -5507,6 +5512,11 @@ typedef struct UA_Client_Subscription {
     UA_UInt32 sequenceNumber;
     UA_DateTime lastActivity;
     LIST_HEAD(UA_ListOfClientMonitoredItems, UA_Client_MonitoredItem) monitoredItems;
+    /* Open addressing hash table of the MonitoredItems by clientHandle, so
+     * that notifications are dispatched without scanning the list */
+    UA_Client_MonitoredItem **monitoredItemsByHandle;
+    size_t monitoredItemsByHandleSize; /* slots, a power of two */
+    size_t monitoredItemsByHandleCount;
 } UA_Client_Subscription;
 
 void
@@ -18662,6 +18672,32 @@ UA_MessageContext_encode(UA_MessageContext *mc, const void *content,
     return retval;
 }
 
+UA_StatusCode
+UA_MessageContext_encodeRaw(UA_MessageContext *mc, const UA_ByteString *raw) {
+    const UA_Byte *src = raw->data;
+    size_t remaining = raw->length;
+    while(remaining > 0) {
+        if(mc->buf_pos >= mc->buf_end) {
+            UA_StatusCode retval =
+                sendSymmetricEncodingCallback(mc, &mc->buf_pos, &mc->buf_end);
+            if(retval != UA_STATUSCODE_GOOD) {
+                if(mc->messageBuffer.length > 0) {
+                    UA_Connection *connection = mc->channel->connection;
+                    connection->releaseSendBuffer(connection, &mc->messageBuffer);
+                }
+                return retval;
+            }
+        }
+        size_t space = (size_t)(mc->buf_end - mc->buf_pos);
+        size_t n = remaining < space ? remaining : space;
+        memcpy(mc->buf_pos, src, n);
+        mc->buf_pos += n;
+        src += n;
+        remaining -= n;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
 UA_StatusCode
 UA_MessageContext_finish(UA_MessageContext *mc) {
     mc->final = true;
@@ -36100,10 +36136,43 @@ typedef struct {
     const UA_DataType *responseType;
 } SyncResponseDescription;
 
+/* Send a request whose body (everything after the request header) is already
+ * binary-encoded. Only the type id and the header are encoded per message. */
+static UA_StatusCode
+sendEncodedServiceRequest(UA_SecureChannel *channel, UA_UInt32 requestId,
+                          const UA_RequestHeader *requestHeader,
+                          const UA_DataType *requestType,
+                          const UA_ByteString *encodedBody) {
+    if(channel->connection && channel->connection->state == UA_CONNECTION_CLOSED)
+        return UA_STATUSCODE_BADCONNECTIONCLOSED;
+
+    UA_MessageContext mc;
+    UA_StatusCode retval = UA_MessageContext_begin(&mc, channel, requestId, UA_MESSAGETYPE_MSG);
+    if(retval != UA_STATUSCODE_GOOD)
+        return retval;
+
+    UA_NodeId typeId = UA_NODEID_NUMERIC(0, requestType->binaryEncodingId);
+    retval = UA_MessageContext_encode(&mc, &typeId, &UA_TYPES[UA_TYPES_NODEID]);
+    if(retval != UA_STATUSCODE_GOOD)
+        return retval;
+
+    retval = UA_MessageContext_encode(&mc, requestHeader, &UA_TYPES[UA_TYPES_REQUESTHEADER]);
+    if(retval != UA_STATUSCODE_GOOD)
+        return retval;
+
+    retval = UA_MessageContext_encodeRaw(&mc, encodedBody);
+    if(retval != UA_STATUSCODE_GOOD)
+        return retval;
+
+    return UA_MessageContext_finish(&mc);
+}
+
 /* For both synchronous and asynchronous service calls */
 static UA_StatusCode
-sendSymmetricServiceRequest(UA_Client *client, const void *request,
-                            const UA_DataType *requestType, UA_UInt32 *requestId) {
+sendSymmetricServiceRequestEx(UA_Client *client, const void *request,
+                              const UA_DataType *requestType,
+                              const UA_ByteString *encodedBody,
+                              UA_UInt32 *requestId) {
     UA_StatusCode retval;
 
     /* If a message is pending in the chunk don't call UA_Client_manuallyRenewSecureChannel
@@ -36129,8 +36198,11 @@ sendSymmetricServiceRequest(UA_Client *client, const void *request,
 
     if (client->channel.nextSecurityToken.tokenId != 0) // Change to the new security token if the secure channel has been renewed.
         UA_SecureChannel_revolveTokens(&client->channel);
-    retval = UA_SecureChannel_sendSymmetricMessage(&client->channel, rqId, UA_MESSAGETYPE_MSG,
-                                                   rr, requestType);
+    if(!encodedBody)
+        retval = UA_SecureChannel_sendSymmetricMessage(&client->channel, rqId, UA_MESSAGETYPE_MSG,
+                                                       rr, requestType);
+    else
+        retval = sendEncodedServiceRequest(&client->channel, rqId, rr, requestType, encodedBody);
     UA_NodeId_init(&rr->authenticationToken); /* Do not return the token to the user */
     if(retval != UA_STATUSCODE_GOOD)
         return retval;
@@ -36139,6 +36211,12 @@ sendSymmetricServiceRequest(UA_Client *client, const void *request,
     return UA_STATUSCODE_GOOD;
 }
 
+static UA_StatusCode
+sendSymmetricServiceRequest(UA_Client *client, const void *request,
+                            const UA_DataType *requestType, UA_UInt32 *requestId) {
+    return sendSymmetricServiceRequestEx(client, request, requestType, NULL, requestId);
+}
+
 static const UA_NodeId
 serviceFaultId = {0, UA_NODEIDTYPE_NUMERIC, {UA_NS0ID_SERVICEFAULT_ENCODING_DEFAULTBINARY}};
 
@@ -36335,16 +36413,17 @@ receiveServiceResponse(UA_Client *client, void *response, const UA_DataType *res
     return retval;
 }
 
-void
-__UA_Client_Service(UA_Client *client, const void *request,
-                    const UA_DataType *requestType, void *response,
-                    const UA_DataType *responseType) {
+static void
+clientServiceEx(UA_Client *client, const void *request,
+                const UA_DataType *requestType, const UA_ByteString *encodedBody,
+                void *response, const UA_DataType *responseType) {
     UA_init(response, responseType);
     UA_ResponseHeader *respHeader = (UA_ResponseHeader*)response;
 
     /* Send the request */
     UA_UInt32 requestId;
-    UA_StatusCode retval = sendSymmetricServiceRequest(client, request, requestType, &requestId);
+    UA_StatusCode retval = sendSymmetricServiceRequestEx(client, request, requestType,
+                                                         encodedBody, &requestId);
     if(retval != UA_STATUSCODE_GOOD) {
         if(retval == UA_STATUSCODE_BADENCODINGLIMITSEXCEEDED)
             respHeader->serviceResult = UA_STATUSCODE_BADREQUESTTOOLARGE;
@@ -36367,6 +36446,54 @@ __UA_Client_Service(UA_Client *client, const void *request,
         respHeader->serviceResult = retval;
 }
 
+void
+__UA_Client_Service(UA_Client *client, const void *request,
+                    const UA_DataType *requestType, void *response,
+                    const UA_DataType *responseType) {
+    clientServiceEx(client, request, requestType, NULL, response, responseType);
+}
+
+UA_StatusCode
+UA_Client_encodeRequestBody(const void *request, const UA_DataType *requestType,
+                            UA_ByteString *body) {
+    UA_ByteString_init(body);
+    size_t headerSize = UA_calcSizeBinary((void*)(uintptr_t)request,
+                                          &UA_TYPES[UA_TYPES_REQUESTHEADER]);
+    size_t requestSize = UA_calcSizeBinary((void*)(uintptr_t)request, requestType);
+    if(requestSize < headerSize)
+        return UA_STATUSCODE_BADENCODINGERROR;
+
+    UA_ByteString encoded;
+    UA_StatusCode retval = UA_ByteString_allocBuffer(&encoded, requestSize);
+    if(retval != UA_STATUSCODE_GOOD)
+        return retval;
+
+    UA_Byte *bufPos = encoded.data;
+    const UA_Byte *bufEnd = &encoded.data[encoded.length];
+    retval = UA_encodeBinary(request, requestType, &bufPos, &bufEnd, NULL, NULL);
+    if(retval != UA_STATUSCODE_GOOD) {
+        UA_ByteString_deleteMembers(&encoded);
+        return retval;
+    }
+
+    /* Keep only the bytes after the request header */
+    size_t bodySize = requestSize - headerSize;
+    if(bodySize > 0) {
+        retval = UA_ByteString_allocBuffer(body, bodySize);
+        if(retval == UA_STATUSCODE_GOOD)
+            memcpy(body->data, &encoded.data[headerSize], bodySize);
+    }
+    UA_ByteString_deleteMembers(&encoded);
+    return retval;
+}
+
+void
+__UA_Client_Service_encodedBody(UA_Client *client, UA_RequestHeader *requestHeader,
+                                const UA_ByteString *body, const UA_DataType *requestType,
+                                void *response, const UA_DataType *responseType) {
+    clientServiceEx(client, requestHeader, requestType, body, response, responseType);
+}
+
 void
 UA_Client_AsyncService_cancel(UA_Client *client, AsyncServiceCall *ac,
                               UA_StatusCode statusCode) {
@@ -36383,6 +36510,20 @@ UA_Client_AsyncService_cancel(UA_Client *client, AsyncServiceCall *ac,
     UA_deleteMembers(resp, ac->responseType);
 }
 
+void
+UA_Client_AsyncService_cancelByRequestId(UA_Client *client, UA_UInt32 requestId,
+                                         UA_StatusCode statusCode) {
+    AsyncServiceCall *ac;
+    LIST_FOREACH(ac, &client->asyncServiceCalls, pointers) {
+        if(ac->requestId == requestId) {
+            LIST_REMOVE(ac, pointers);
+            UA_Client_AsyncService_cancel(client, ac, statusCode);
+            UA_free(ac);
+            return;
+        }
+    }
+}
+
 void UA_Client_AsyncService_removeAll(UA_Client *client, UA_StatusCode statusCode) {
     AsyncServiceCall *ac, *ac_tmp;
     LIST_FOREACH_SAFE(ac, &client->asyncServiceCalls, pointers, ac_tmp) {
@@ -36529,6 +36670,24 @@ UA_Client_runAsync(UA_Client *client, UA_UInt16 timeout) {
     return retval;
 }
 
+UA_StatusCode
+UA_Client_receiveAsyncResponse(UA_Client *client, UA_UInt32 timeout) {
+    SyncResponseDescription rd = { client, false, 0, NULL, NULL };
+    UA_StatusCode retval =
+        UA_Connection_receiveChunksBlocking(&client->connection, &rd, client_processChunk, timeout);
+    if(retval != UA_STATUSCODE_GOOD && retval != UA_STATUSCODE_GOODNONCRITICALTIMEOUT) {
+        if(retval == UA_STATUSCODE_BADCONNECTIONCLOSED)
+            setClientState(client, UA_CLIENTSTATE_DISCONNECTED);
+        UA_Client_close(client);
+    }
+    return retval;
+}
+
+UA_ConnectionConfig
+UA_Client_getRemoteConnectionConfig(const UA_Client *client) {
+    return client->connection.remoteConf;
+}
+
 /*********************************** amalgamated original file "/home/travis/build/open62541/open62541/src/client/ua_client_connect.c" ***********************************/
 
 /* This Source Code Form is subject to the terms of the Mozilla Public
@@ -37800,6 +37959,9 @@ UA_Client_Subscriptions_create(UA_Client *client,
     newSub->publishingInterval = response.revisedPublishingInterval;
     newSub->maxKeepAliveCount = response.revisedMaxKeepAliveCount;
     LIST_INIT(&newSub->monitoredItems);
+    newSub->monitoredItemsByHandle = NULL;
+    newSub->monitoredItemsByHandleSize = 0;
+    newSub->monitoredItemsByHandleCount = 0;
     LIST_INSERT_HEAD(&client->subscriptions, newSub, listEntry);
 
     return response;
@@ -37851,6 +38013,7 @@ UA_Client_Subscription_deleteInternal(UA_Client *client, UA_Client_Subscription
 
     /* Remove */
     LIST_REMOVE(sub, listEntry);
+    UA_free(sub->monitoredItemsByHandle);
     UA_free(sub);
 }
 
@@ -37941,9 +38104,99 @@ UA_Client_Subscriptions_deleteSingle(UA_Client *client, UA_UInt32 subscriptionId
 /* MonitoredItems */
 /******************/
 
+static size_t
+monitoredItemHandleSlot(const UA_Client_Subscription *sub, UA_UInt32 clientHandle) {
+    /* Handles are handed out sequentially, spread them over the table */
+    return (size_t)(clientHandle * 2654435761u) & (sub->monitoredItemsByHandleSize - 1);
+}
+
+static UA_Client_MonitoredItem *
+findMonitoredItemByHandle(const UA_Client_Subscription *sub, UA_UInt32 clientHandle) {
+    if(sub->monitoredItemsByHandleSize > 0) {
+        size_t mask = sub->monitoredItemsByHandleSize - 1;
+        for(size_t i = monitoredItemHandleSlot(sub, clientHandle);
+            sub->monitoredItemsByHandle[i]; i = (i + 1) & mask) {
+            if(sub->monitoredItemsByHandle[i]->clientHandle == clientHandle)
+                return sub->monitoredItemsByHandle[i];
+        }
+    }
+
+    /* Items that could not be indexed for lack of memory */
+    UA_Client_MonitoredItem *mon;
+    LIST_FOREACH(mon, &sub->monitoredItems, listEntry) {
+        if(mon->clientHandle == clientHandle)
+            break;
+    }
+    return mon;
+}
+
+static void
+indexMonitoredItemSlot(UA_Client_Subscription *sub, UA_Client_MonitoredItem *mon) {
+    size_t mask = sub->monitoredItemsByHandleSize - 1;
+    size_t i = monitoredItemHandleSlot(sub, mon->clientHandle);
+    while(sub->monitoredItemsByHandle[i])
+        i = (i + 1) & mask;
+    sub->monitoredItemsByHandle[i] = mon;
+}
+
+/* Keeps the table at most half full. Without memory for a larger table the
+ * item stays only in the list, where findMonitoredItemByHandle still finds
+ * it. */
+static void
+indexMonitoredItem(UA_Client_Subscription *sub, UA_Client_MonitoredItem *mon) {
+    if((sub->monitoredItemsByHandleCount + 1) * 2 > sub->monitoredItemsByHandleSize) {
+        size_t oldSize = sub->monitoredItemsByHandleSize;
+        UA_Client_MonitoredItem **oldTable = sub->monitoredItemsByHandle;
+        size_t newSize = oldSize ? oldSize * 2 : 64;
+        UA_Client_MonitoredItem **newTable = (UA_Client_MonitoredItem **)
+            UA_calloc(newSize, sizeof(UA_Client_MonitoredItem *));
+        if(!newTable)
+            return;
+
+        sub->monitoredItemsByHandle = newTable;
+        sub->monitoredItemsByHandleSize = newSize;
+        for(size_t i = 0; i < oldSize; i++) {
+            if(oldTable[i])
+                indexMonitoredItemSlot(sub, oldTable[i]);
+        }
+        UA_free(oldTable);
+    }
+
+    indexMonitoredItemSlot(sub, mon);
+    sub->monitoredItemsByHandleCount++;
+}
+
+/* Removes by shifting the following entries of the probe sequence back */
+static void
+unindexMonitoredItem(UA_Client_Subscription *sub, UA_Client_MonitoredItem *mon) {
+    if(sub->monitoredItemsByHandleSize == 0)
+        return;
+
+    size_t mask = sub->monitoredItemsByHandleSize - 1;
+    size_t i = monitoredItemHandleSlot(sub, mon->clientHandle);
+    while(sub->monitoredItemsByHandle[i] && sub->monitoredItemsByHandle[i] != mon)
+        i = (i + 1) & mask;
+    if(!sub->monitoredItemsByHandle[i])
+        return;
+
+    sub->monitoredItemsByHandle[i] = NULL;
+    sub->monitoredItemsByHandleCount--;
+
+    for(size_t j = (i + 1) & mask; sub->monitoredItemsByHandle[j]; j = (j + 1) & mask) {
+        size_t home = monitoredItemHandleSlot(sub, sub->monitoredItemsByHandle[j]->clientHandle);
+        /* Move the entry unless its home slot lies cyclically in (i, j] */
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            sub->monitoredItemsByHandle[i] = sub->monitoredItemsByHandle[j];
+            sub->monitoredItemsByHandle[j] = NULL;
+            i = j;
+        }
+    }
+}
+
 void
 UA_Client_MonitoredItem_remove(UA_Client *client, UA_Client_Subscription *sub,
                                UA_Client_MonitoredItem *mon) {
+    unindexMonitoredItem(sub, mon);
     LIST_REMOVE(mon, listEntry);
     if(mon->deleteCallback)
         mon->deleteCallback(client, sub->subscriptionId, sub->context,
@@ -38021,6 +38274,7 @@ __UA_Client_MonitoredItems_create(UA_Client *client,
         newMon->isEventMonitoredItem =
             (request->itemsToCreate[i].itemToMonitor.attributeId == UA_ATTRIBUTEID_EVENTNOTIFIER);
         LIST_INSERT_HEAD(&sub->monitoredItems, newMon, listEntry);
+        indexMonitoredItem(sub, newMon);
     }
 
     return;
@@ -38225,11 +38479,7 @@ processDataChangeNotification(UA_Client *client, UA_Client_Subscription *sub,
         UA_MonitoredItemNotification *min = &dataChangeNotification->monitoredItems[j];
 
         /* Find the MonitoredItem */
-        UA_Client_MonitoredItem *mon;
-        LIST_FOREACH(mon, &sub->monitoredItems, listEntry) {
-            if(mon->clientHandle == min->clientHandle)
-                break;
-        }
+        UA_Client_MonitoredItem *mon = findMonitoredItemByHandle(sub, min->clientHandle);
 
         if(!mon) {
             UA_LOG_DEBUG(client->config.logger, UA_LOGCATEGORY_CLIENT,
@@ -38408,6 +38658,9 @@ UA_Client_Subscriptions_processPublishResponse(UA_Client *client, UA_PublishRequ
     for(size_t k = 0; k < msg->notificationDataSize; ++k)
         processNotificationMessage(client, sub, &msg->notificationData[k]);
 
+    if(msg->notificationDataSize && client->config.notificationsProcessedCallback)
+        client->config.notificationsProcessedCallback(client, sub->subscriptionId, sub->context);
+
     /* Add to the list of pending acks */
     for(size_t i = 0; i < response->availableSequenceNumbersSize; i++) {
         if(response->availableSequenceNumbers[i] != msg->sequenceNumber)
@@ -41822,7 +42075,10 @@ const UA_ClientConfig UA_ClientConfig_default = {
 #ifdef UA_ENABLE_SUBSCRIPTIONS
     10, /* .outStandingPublishRequests */
 #endif
-    0 /* .connectivityCheckInterval */
+    0, /* .connectivityCheckInterval */
+#ifdef UA_ENABLE_SUBSCRIPTIONS
+    NULL /* .notificationsProcessedCallback */
+#endif
 };
 
 UA_ClientConfig UA_Server_getClientConfig(void)
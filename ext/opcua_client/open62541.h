@@ -13857,6 +13857,14 @@ typedef struct UA_ClientConfig {
     /* connectivity check interval in ms
      * 0 = background task disabled */
     UA_UInt32 connectivityCheckInterval;
+
+#ifdef UA_ENABLE_SUBSCRIPTIONS
+    /* Called after the notifications of a PublishResponse have been passed
+     * to the callbacks of the monitored items, so that the client can handle
+     * them as one batch */
+    void (*notificationsProcessedCallback)(UA_Client *client, UA_UInt32 subId,
+                                           void *subContext);
+#endif
 } UA_ClientConfig;
 
 
@@ -14060,6 +14068,22 @@ __UA_Client_Service(UA_Client *client, const void *request,
                     const UA_DataType *requestType, void *response,
                     const UA_DataType *responseType);
 
+/* Encode everything after the request header of a service request. The result
+ * can be sent repeatedly with __UA_Client_Service_encodedBody, which encodes
+ * only the (per-request) header and copies the cached body behind it. */
+UA_StatusCode UA_EXPORT
+UA_Client_encodeRequestBody(const void *request, const UA_DataType *requestType,
+                            UA_ByteString *body);
+
+/* Size of the binary encoding of p, zero if p cannot be encoded */
+size_t UA_EXPORT
+UA_calcSizeBinary(void *p, const UA_DataType *type);
+
+void UA_EXPORT
+__UA_Client_Service_encodedBody(UA_Client *client, UA_RequestHeader *requestHeader,
+                                const UA_ByteString *body, const UA_DataType *requestType,
+                                void *response, const UA_DataType *responseType);
+
 /*
  * Attribute Service Set
  * ^^^^^^^^^^^^^^^^^^^^^ */
@@ -14216,6 +14240,19 @@ UA_Client_Service_queryNext(UA_Client *client,
 UA_StatusCode UA_EXPORT
 UA_Client_runAsync(UA_Client *client, UA_UInt16 timeout);
 
+/* Wait up to timeout (in ms) for the next message from the server and process
+ * it. Responses to async service calls are forwarded to their callbacks.
+ * Unlike UA_Client_runAsync, no publish requests or connectivity checks are
+ * sent. Returns UA_STATUSCODE_GOODNONCRITICALTIMEOUT if nothing arrived. */
+UA_StatusCode UA_EXPORT
+UA_Client_receiveAsyncResponse(UA_Client *client, UA_UInt32 timeout);
+
+/* The connection limits the server announced in its Acknowledge message.
+ * maxMessageSize and maxChunkCount are zero if unlimited. All fields are zero
+ * before a connection was established. */
+UA_ConnectionConfig UA_EXPORT
+UA_Client_getRemoteConnectionConfig(const UA_Client *client);
+
 typedef void
 (*UA_ClientAsyncServiceCallback)(UA_Client *client, void *userdata,
                                  UA_UInt32 requestId, void *response,
@@ -14248,6 +14285,17 @@ __UA_Client_AsyncService(UA_Client *client, const void *request,
                          const UA_DataType *responseType,
                          void *userdata, UA_UInt32 *requestId);
 
+/* Remove a dispatched async service call. Its callback is called right away
+ * with an "empty" response carrying the statusCode. */
+void UA_EXPORT
+UA_Client_AsyncService_cancelByRequestId(UA_Client *client, UA_UInt32 requestId,
+                                         UA_StatusCode statusCode);
+
+/* Remove all dispatched async service calls, calling their callbacks with an
+ * "empty" response carrying the statusCode. */
+void UA_EXPORT
+UA_Client_AsyncService_removeAll(UA_Client *client, UA_StatusCode statusCode);
+
 /* Use the type versions of this method. See below. However, the general
  * mechanism of async service calls is explained here.
  *
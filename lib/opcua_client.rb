@@ -16,3 +16,4 @@ end
 
 require "opcua_client/opcua_client"
 require "opcua_client/client"
+require "opcua_client/node_id"
@@ -8,6 +8,77 @@ module OPCUAClient
       @callback_after_data_changed = block
     end
 
+    # Numo::NArray classes for the element types of read_array_with_type
+    NUMO_TYPES = {
+      boolean: "UInt8", sbyte: "Int8", byte: "UInt8",
+      int16: "Int16", uint16: "UInt16", int32: "Int32", uint32: "UInt32",
+      int64: "Int64", uint64: "UInt64", float: "SFloat", double: "DFloat",
+    }.freeze
+
+    def read_array(*node, numo: false)
+      type, data = read_array_with_type(*node)
+      return data unless numo
+
+      require "numo/narray"
+      Numo.const_get(NUMO_TYPES.fetch(type)).from_binary(data)
+    end
+
+    # Writes value with the node's own DataType, see multi_write. The node is
+    # an OPCUAClient::NodeId or ns, name.
+    def write(*node, value)
+      node = node.size == 1 ? node.first : OPCUAClient::NodeId.new(*node)
+      multi_write([[node, value]])
+    end
+
+    # Sends one write without waiting for the response, see multi_write_async
+    def write_async(node, type = nil, value, &block)
+      multi_write_async([type ? [node, type, value] : [node, value]], &block)
+    end
+
+    # Queues a write of value to node (an OPCUAClient::NodeId), to be sent
+    # with the other queued writes in one request by flush_writes. A later
+    # write to the same node replaces the queued one. Without a type, it is
+    # taken from the value as for multi_write.
+    def enqueue_write(node, type = nil, value)
+      raise OPCUAClient::Error, "Invalid arguments" unless node.is_a?(OPCUAClient::NodeId)
+
+      raise_write_flush_error
+
+      entry = type ? [node, type, value] : [node, value]
+      write_queue_lock.synchronize do
+        if queued_writes.empty?
+          @queued_writes_since = monotonic_ms
+          write_queue_signal.signal
+        end
+        queued_writes[node] = entry
+      end
+      nil
+    end
+
+    # Sends the queued writes, returns how many nodes were written. If the
+    # write fails, the writes taken from the queue are dropped.
+    def flush_writes
+      raise_write_flush_error
+      send_queued_writes
+    end
+
+    # With an interval, a background thread flushes the queue as soon as its
+    # oldest write has been waiting that many ms. nil stops the thread. The
+    # error of a failed background flush is raised by the next enqueue_write
+    # or flush_writes.
+    def auto_flush_writes(interval_ms)
+      write_queue_lock.synchronize do
+        @write_flush_interval_ms = interval_ms
+        write_queue_signal.signal
+        @write_flusher = Thread.new { run_write_flusher } if interval_ms && !@write_flusher&.alive?
+      end
+      nil
+    end
+
+    def queued_writes_count
+      write_queue_lock.synchronize { queued_writes.size }
+    end
+
     def human_state
       state = self.state
 
@@ -18,5 +89,65 @@ module OPCUAClient
       elsif state == OPCUAClient::UA_CLIENTSTATE_SESSION_RENEWED; "UA_CLIENTSTATE_SESSION_RENEWED"
       end
     end
+
+    private
+
+    def queued_writes
+      @queued_writes ||= {}
+    end
+
+    def write_queue_lock
+      @write_queue_lock ||= Mutex.new
+    end
+
+    def send_queued_writes
+      entries = write_queue_lock.synchronize do
+        taken = queued_writes
+        @queued_writes = {}
+        taken
+      end
+
+      multi_write(entries.values) unless entries.empty?
+      entries.size
+    end
+
+    def write_queue_signal
+      @write_queue_signal ||= ConditionVariable.new
+    end
+
+    # Body of the auto_flush_writes thread, returns once the interval is nil
+    def run_write_flusher
+      loop do
+        write_queue_lock.synchronize do
+          loop do
+            return unless @write_flush_interval_ms
+
+            if queued_writes.empty?
+              write_queue_signal.wait(write_queue_lock)
+            else
+              wait_ms = @queued_writes_since + @write_flush_interval_ms - monotonic_ms
+              break if wait_ms <= 0
+
+              write_queue_signal.wait(write_queue_lock, wait_ms / 1000.0)
+            end
+          end
+        end
+
+        begin
+          send_queued_writes
+        rescue StandardError => e
+          @write_flush_error = e
+        end
+      end
+    end
+
+    def raise_write_flush_error
+      error, @write_flush_error = @write_flush_error, nil
+      raise error if error
+    end
+
+    def monotonic_ms
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)
+    end
   end
 end
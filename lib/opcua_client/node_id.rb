@@ -0,0 +1,36 @@
+module OPCUAClient
+  class NodeId
+    PREFIXES = { numeric: "i", string: "s", guid: "g", bytestring: "b" }.freeze
+
+    # Parses the standard notation, e.g. "ns=3;i=1042", "ns=2;s=Line1.Speed",
+    # "g=72962B91-FA75-4AE6-8D28-B404DC7DAF63" or "ns=1;b=M/RbKBsRVkePCePcx24oRA=="
+    def self.parse(str)
+      match = /\A(?:ns=(\d+);)?([isgb])=(.*)\z/m.match(str)
+      raise OPCUAClient::Error, "Invalid NodeId: #{str}" unless match
+
+      ns = match[1].to_i
+      identifier = match[3]
+
+      case match[2]
+      when "i"
+        raise OPCUAClient::Error, "Invalid NodeId: #{str}" unless identifier =~ /\A\d+\z/
+        new(ns, identifier.to_i, :numeric)
+      when "s" then new(ns, identifier, :string)
+      when "g" then new(ns, identifier, :guid)
+      when "b" then new(ns, identifier.unpack1("m"), :bytestring)
+      end
+    end
+
+    def to_s
+      identifier = self.identifier
+      identifier = [identifier].pack("m0") if identifier_type == :bytestring
+      ns = namespace_index.zero? ? "" : "ns=#{namespace_index};"
+
+      "#{ns}#{PREFIXES[identifier_type]}=#{identifier}"
+    end
+
+    def inspect
+      "#<OPCUAClient::NodeId #{self}>"
+    end
+  end
+end
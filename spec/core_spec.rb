@@ -11,5 +11,430 @@ RSpec.describe OPCUAClient::Client do
       state = new_client(connect: false).state
       expect(state).to eq(0)
     end
+
+    it "queues one write per node" do
+      client = new_client(connect: false)
+      node = OPCUAClient::NodeId.new(5, "uint32a")
+      client.enqueue_write(node, :uint32, 1)
+      client.enqueue_write(OPCUAClient::NodeId.new(5, "uint32a"), :uint32, 2)
+      expect(client.queued_writes_count).to eq(1)
+    end
+
+    it "drains nothing from an empty change queue" do
+      client = new_client(connect: false)
+      client.change_queue_capacity = 16
+      mon_ids, statuses, server_times, source_times, values = client.drain_changes(8)
+      expect(mon_ids).to eq("")
+      expect(values).to eq([])
+      expect(client.change_queue_stats).to eq([0, 0])
+    end
+
+    it "interrupts a call waiting for the server" do
+      silent = TCPServer.new("127.0.0.1", 0)
+      client = new_client(connect: false)
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      expect {
+        Timeout.timeout(0.2) { client.connect("opc.tcp://127.0.0.1:#{silent.addr[1]}") }
+      }.to raise_error(Timeout::Error)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 2
+    ensure
+      silent&.close
+    end
+  end
+
+  context "connected", server: true do
+    let(:client) { new_client }
+
+    after { client.disconnect }
+
+    # Runs monitoring cycles until the block is true, for at most 5 s
+    def cycle_until
+      50.times do
+        break if yield
+        client.run_mon_cycle(timeout_ms: 100)
+      end
+    end
+
+    it "is shared by several threads" do
+      threads = 4.times.map do |i|
+        Thread.new do
+          20.times { client.write_uint32(5, "uint32a", i) }
+          client.read_uint32(5, "uint32a")
+        end
+      end
+
+      expect(threads.map(&:value)).to all(be_between(0, 3))
+    end
+
+    it "interrupts a monitoring cycle and stays connected" do
+      subscription = client.create_subscription
+      client.add_monitored_item(subscription, 5, "uint32a")
+      client.run_mon_cycle(timeout_ms: 1000)
+
+      expect { Timeout.timeout(0.2) { client.run_mon_cycle(timeout_ms: 5000) } }.to raise_error(Timeout::Error)
+      expect(client.state).to eq(OPCUAClient::UA_CLIENTSTATE_SESSION)
+    end
+
+    it "reads a status per node" do
+      client.write_uint32(5, "uint32b", 1001)
+      good, bad = client.multi_read_with_status(5, ["uint32b", "missing"])
+
+      expect(good[0..1]).to eq([1001, 0])
+      expect(good[2]).to be_a(Time)
+      expect(bad).to eq([nil, 0x80340000, nil, nil])
+    end
+
+    it "splits reads and writes of more than 1000 nodes, keeping their order" do
+      names = ["uint32a", "uint32b", "uint32c"] * 834
+      values = names.each_index.map { |i| i }
+      client.multi_write_uint32(5, names, values)
+
+      expect(client.multi_read(5, names)).to eq([2499, 2500, 2501] * 834)
+    end
+
+    it "reads arrays as packed strings" do
+      type, data = client.read_array_with_type(5, "int16_array")
+
+      expect(type).to eq(:int16)
+      expect(data.encoding).to eq(Encoding::BINARY)
+      expect(data.unpack("s*")).to eq((-500...500).to_a)
+      expect(client.multi_read(5, ["int16_array"])).to eq([data])
+    end
+
+    it "converts values of each type" do
+      client.write_int16(2, "int16a", -7)
+      client.write_int32(2, "int32a", -70_000)
+      client.write_float(2, "floata", 1.5)
+      client.write_boolean(5, "false_var", false)
+
+      expect(client.read_value(2, "int16a")).to eq(-7)
+      expect(client.read_value(2, "int32a")).to eq(-70_000)
+      expect(client.read_value(2, "floata")).to eq(1.5)
+      expect(client.read_value(5, "false_var")).to eq(false)
+      expect(client.read_value(OPCUAClient::NodeId.new(0, 2255))).to include("http://opcfoundation.org/UA/", "ns5")
+      expect { client.read_int16(2, "int32a") }.to raise_error(OPCUAClient::Error)
+    end
+
+    it "writes mixed types and namespaces in one multi_write" do
+      client.multi_write([
+        [OPCUAClient::NodeId.new(2, "int16a"), :int16, 120],
+        [OPCUAClient::NodeId.new(2, "doublea"), :double, 0.75],
+        [OPCUAClient::NodeId.new(2, "stringa"), :string, "Bread"],
+        [OPCUAClient::NodeId.new(5, "true_var"), :boolean, true],
+        [OPCUAClient::NodeId.new(5, "uint16b"), :uint16, 65_535],
+      ])
+
+      expect(client.multi_read(2, ["int16a", "doublea", "stringa"])).to eq([120, 0.75, "Bread"])
+      expect(client.multi_read(5, ["true_var", "uint16b"])).to eq([true, 65_535])
+    end
+
+    it "stages values of any size for consecutive writes" do
+      ["", "short", "long" * 5000].each do |text|
+        client.multi_write([
+          [OPCUAClient::NodeId.new(2, "stringa"), :string, text],
+          [OPCUAClient::NodeId.new(2, "int32a"), :int32, text.size],
+        ])
+
+        expect(client.multi_read(2, ["stringa", "int32a"])).to eq([text, text.size])
+      end
+    end
+
+    it "flushes queued writes" do
+      node = OPCUAClient::NodeId.new(5, "uint32a")
+      client.enqueue_write(node, :uint32, 41)
+      client.enqueue_write(node, :uint32, 42)
+      client.enqueue_write(OPCUAClient::NodeId.new(5, "uint16c"), :uint16, 43)
+
+      expect(client.flush_writes).to eq(2)
+      expect(client.multi_read(5, ["uint32a", "uint16c"])).to eq([42, 43])
+    end
+
+    it "flushes the last queued write in the background" do
+      client.auto_flush_writes(20)
+      client.enqueue_write(OPCUAClient::NodeId.new(5, "uint32a"), :uint32, 44)
+      sleep(0.3)
+
+      expect(client.queued_writes_count).to eq(0)
+      expect(client.read_uint32(5, "uint32a")).to eq(44)
+
+      client.enqueue_write(OPCUAClient::NodeId.new(5, "missing"), :uint32, 1)
+      sleep(0.3)
+      expect { client.flush_writes }.to raise_error(OPCUAClient::Error)
+    ensure
+      client.auto_flush_writes(nil)
+    end
+
+    it "settles futures of asynchronous writes" do
+      statuses = []
+      node = OPCUAClient::NodeId.new(5, "uint32b")
+      futures = (1..5).map { |i| client.write_async(node, :uint32, i) { |status| statuses << status } }
+      futures.last.wait
+
+      expect(futures.map(&:done?)).to all(eq(true))
+      expect(futures.map(&:status)).to all(eq(0))
+      expect(statuses).to eq([0] * 5)
+      expect(client.read_uint32(5, "uint32b")).to eq(5)
+
+      failed = client.write_async(OPCUAClient::NodeId.new(5, "missing"), :uint32, 1)
+      expect { failed.wait }.to raise_error(OPCUAClient::Error)
+      expect(failed.status).to eq(0x80340000)
+    end
+
+    it "writes with the node's own data type" do
+      client.write(5, "uint16a", 7)
+      client.write(OPCUAClient::NodeId.new(2, "doublea"), 2)
+
+      expect(client.read_uint16(5, "uint16a")).to eq(7)
+      expect(client.read_value(2, "doublea")).to eq(2.0)
+      expect { client.write(5, "int16_array", 3) }.to raise_error(OPCUAClient::Error, "UA type mismatch")
+    end
+
+    it "skips writes of unchanged values" do
+      client.write_if_changed = true
+      names = ["uint32a", "uint32b", "uint32c"]
+
+      client.multi_write_uint32(5, names, [51, 52, 53])
+      client.multi_write_uint32(5, names, [51, 52, 54])
+      expect(client.write_stats).to eq(written: 4, skipped: 2)
+      expect(client.multi_read(5, names)).to eq([51, 52, 54])
+
+      rejected = [[OPCUAClient::NodeId.new(5, "uint32a"), :int16, 5]]
+      2.times { expect(client.multi_write_with_status(rejected)).to eq([0x80740000]) }
+      expect(client.write_stats).to eq(written: 6, skipped: 2)
+
+      client.write_if_changed = false
+      client.multi_write_uint32(5, names, [51, 52, 54])
+      expect(client.write_stats).to eq(written: 9, skipped: 2)
+    end
+
+    it "returns a status per written item and retries only temporary failures" do
+      entries = [
+        [OPCUAClient::NodeId.new(5, "uint32c"), :uint32, 61],
+        [OPCUAClient::NodeId.new(5, "missing"), :uint32, 62],
+        [OPCUAClient::NodeId.new(5, "uint16c"), :int32, 63],
+      ]
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      statuses = client.multi_write_with_status(entries, retries: 3, backoff_ms: 500)
+
+      expect(statuses).to eq([0, 0x80340000, 0x80740000])
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 0.5
+      expect(client.read_uint32(5, "uint32c")).to eq(61)
+    end
+
+    it "writes packed arrays" do
+      samples = (0...1000).map { |i| i * 0.25 }.pack("f*")
+      client.write_array(5, "float_array", :float, samples)
+
+      expect(client.read_array_with_type(5, "float_array")).to eq([:float, samples])
+    end
+
+    it "delivers data changes in batches" do
+      batches = []
+      client.after_data_changed_batch { |*args| batches << args }
+      subscription = client.create_subscription(publishing_interval: 50)
+      names = ["uint32a", "uint32b", "uint32c"]
+      ids = client.add_monitored_items(subscription, 5, names, sampling_interval: 10).map(&:first)
+      cycle_until { batches.sum { |batch| batch[1].size } == 3 }
+
+      batches.clear
+      values = client.multi_read(5, names).map { |value| value + 1 }
+      client.multi_write_uint32(5, names, values)
+      cycle_until { batches.sum { |batch| batch[1].size } == 3 }
+
+      changes = batches.flat_map { |_, mon_ids, _, _, new_values, statuses| mon_ids.zip(new_values, statuses) }
+      expect(batches.map(&:first)).to all(eq(subscription))
+      expect(changes.sort).to eq(ids.zip(values, [0, 0, 0]).sort)
+      expect(batches.flat_map(&:last)).to eq([nil, nil, nil])
+    end
+
+    it "returns timestamps as epoch nanoseconds" do
+      client.timestamp_format = :epoch_ns
+      _, _, server_time, source_time = client.multi_read_with_status(5, ["uint32a"]).first
+      now_ns = Time.now.to_r * 1_000_000_000
+
+      expect(server_time).to be_a(Integer)
+      expect(server_time).to be_within(60 * 1_000_000_000).of(now_ns)
+      expect(source_time).to be_a(Integer)
+
+      client.timestamp_format = :time
+      expect(client.multi_read_with_status(5, ["uint32a"]).first[2]).to be_a(Time)
+    end
+
+    it "creates monitored items in bulk" do
+      subscription = client.create_subscription
+      names = ["uint32a", "missing"] + ["uint16a"] * 2500
+      results = client.add_monitored_items(subscription, 5, names)
+
+      expect(results.size).to eq(2502)
+      expect(results[0]).to satisfy { |id, status| id.is_a?(Integer) && status == 0 }
+      expect(results[1]).to eq([nil, 0x80340000])
+      expect(results.drop(2).map(&:last)).to all(eq(0))
+      expect(results.map(&:first).compact.uniq.size).to eq(2501)
+    end
+
+    it "filters changes within the deadband" do
+      values = []
+      client.after_data_changed { |_, _, _, _, value| values << value }
+      subscription = client.create_subscription(publishing_interval: 50, keep_alive_count: 5, priority: 1)
+      client.write_int32(2, "int32a", 1000)
+      client.add_monitored_item(subscription, 2, "int32a", sampling_interval: 10, deadband: 10.0, queue_size: 1)
+      cycle_until { values == [1000] }
+
+      client.write_int32(2, "int32a", 1005)
+      3.times { client.run_mon_cycle(timeout_ms: 100) }
+      client.write_int32(2, "int32a", 1100)
+      cycle_until { values.size == 2 }
+
+      expect(values).to eq([1000, 1100])
+    end
+
+    it "dispatches each notification to its monitored item" do
+      latest = {}
+      client.after_data_changed { |_, mon_id, _, _, value| latest[mon_id] = value }
+      subscription = client.create_subscription(publishing_interval: 50)
+      names = ["uint32a", "uint32b", "uint32c"] * 100
+      ids = client.add_monitored_items(subscription, 5, names, sampling_interval: 10).map(&:first)
+      cycle_until { latest.size == 300 }
+
+      values = [71, 72, 73].map { |value| value + latest.values.max }
+      client.multi_write_uint32(5, names.first(3), values)
+      cycle_until { latest.values.count { |value| values.include?(value) } == 300 }
+
+      expect(ids.map { |id| latest[id] }).to eq(values * 100)
+    end
+
+    it "passes each item's context to the callbacks" do
+      received = []
+      client.after_data_changed { |*args| received << args }
+      subscription = client.create_subscription(publishing_interval: 50)
+      client.add_monitored_item(subscription, 5, "uint16a", context: :tag_a)
+      client.add_monitored_items(subscription, 5, ["uint16b", "uint16c"], contexts: [:tag_b, nil])
+      cycle_until { received.size == 3 }
+
+      expect(received.map(&:size)).to all(eq(6))
+      expect(received.map(&:last).sort_by(&:to_s)).to eq([nil, :tag_a, :tag_b].sort_by(&:to_s))
+
+      batches = []
+      client.after_data_changed_batch { |*args| batches << args }
+      client.write_uint16(5, "uint16a", client.read_uint16(5, "uint16a") + 1)
+      cycle_until { batches.any? }
+      expect(batches.first.last).to eq([:tag_a])
+      expect { client.add_monitored_items(subscription, 5, ["uint16a"], contexts: []) }.to raise_error(OPCUAClient::Error)
+    end
+
+    it "calls five-parameter lambdas without the context" do
+      values = []
+      client.after_data_changed(&->(_sub_id, _mon_id, _server_time, _source_time, value) { values << value })
+      subscription = client.create_subscription(publishing_interval: 50)
+      client.add_monitored_item(subscription, 5, "uint16a", context: :tag_a)
+      cycle_until { values.any? }
+
+      expect(values.first).to eq(client.read_uint16(5, "uint16a"))
+    end
+
+    it "queues data changes for drain_changes" do
+      called = false
+      client.after_data_changed { called = true }
+      client.change_queue_capacity = 2
+      subscription = client.create_subscription(publishing_interval: 50)
+      names = ["uint32a", "uint32b", "uint32c"]
+      ids = client.add_monitored_items(subscription, 5, names).map(&:first)
+      cycle_until { client.change_queue_stats == [2, 1] }
+
+      mon_ids, statuses, server_times, _, values = client.drain_changes(5)
+      expect(called).to eq(false)
+      expect(mon_ids.unpack("L*").size).to eq(2)
+      expect(mon_ids.unpack("L*") - ids).to eq([])
+      expect(statuses.unpack("L*")).to eq([0, 0])
+      expect(server_times.unpack("q*")).to all(be > 0)
+      expect(values).to eq(mon_ids.unpack("L*").map { |id| client.read_uint32(5, names[ids.index(id)]) })
+      expect(client.change_queue_stats).to eq([0, 1])
+    end
+  end
+end
+
+RSpec.describe OPCUAClient::ReadPlan do
+  it "prepares the given nodes" do
+    plan = OPCUAClient::ReadPlan.new(5, ["uint32a", "uint32b"])
+    expect(plan.size).to eq(2)
+  end
+
+  it "accepts the register option" do
+    plan = OPCUAClient::ReadPlan.new(5, ["uint32a"], register: true)
+    expect(plan.size).to eq(1)
+  end
+
+  it "rejects non-string names" do
+    expect { OPCUAClient::ReadPlan.new(5, [1]) }.to raise_error(OPCUAClient::Error)
+  end
+
+  context "connected", server: true do
+    let(:client) { new_client }
+
+    after { client.disconnect }
+
+    it "reads its nodes" do
+      client.multi_write_uint32(5, ["uint32a", "uint32b"], [11, 12])
+      plan = OPCUAClient::ReadPlan.new(5, ["uint32a", "uint32b", "true_var"])
+
+      expect(client.read(plan)).to eq([11, 12, true])
+      expect(client.read_with_status(plan).map { |value, status, *| [value, status] }).to eq([[11, 0], [12, 0], [true, 0]])
+    end
+
+    it "reads current values each time from the cached request" do
+      plan = OPCUAClient::ReadPlan.new(5, ["uint32a"])
+
+      [21, 22, 23].each do |value|
+        client.write_uint32(5, "uint32a", value)
+        expect(client.read(plan)).to eq([value])
+      end
+
+      client.disconnect
+      client.connect(SERVER_URL)
+      expect(client.read(plan)).to eq([23])
+    end
+
+    it "reads through registered nodes and belongs to one client" do
+      client.write_uint32(5, "uint32c", 31)
+      plan = OPCUAClient::ReadPlan.new(5, ["uint32c"], register: true)
+      expect(client.read(plan)).to eq([31])
+
+      other = new_client
+      expect { other.read(plan) }.to raise_error(OPCUAClient::Error)
+      other.disconnect
+
+      alias_node = client.register_nodes(5, ["uint32c"]).first
+      expect(client.read_uint32(alias_node)).to eq(31)
+      client.unregister_nodes([alias_node])
+    end
+  end
+end
+
+RSpec.describe OPCUAClient::NodeId do
+  it "parses and formats the standard notation" do
+    node = OPCUAClient::NodeId.parse("ns=3;i=1042")
+    expect(node.namespace_index).to eq(3)
+    expect(node.identifier).to eq(1042)
+    expect(node.to_s).to eq("ns=3;i=1042")
+  end
+
+  it "compares by value" do
+    expect(OPCUAClient::NodeId.parse("ns=2;s=Speed")).to eq(OPCUAClient::NodeId.new(2, "Speed"))
+  end
+
+  context "connected", server: true do
+    let(:client) { new_client }
+
+    after { client.disconnect }
+
+    it "addresses numeric and string nodes" do
+      current_time = OPCUAClient::NodeId.parse("ns=0;i=2258") # Server_ServerStatus_CurrentTime
+      expect(client.read_value(current_time)).to be_a(Time)
+
+      node = OPCUAClient::NodeId.parse("ns=5;s=uint16a")
+      client.write_uint16(node, 41)
+      expect(client.multi_read([node, OPCUAClient::NodeId.new(5, "true_var")])).to eq([41, true])
+    end
   end
 end
@@ -1,4 +1,6 @@
 require 'rspec'
+require 'socket'
+require 'timeout'
 require 'opcua_client'
 
 # https://github.com/brianmario/mysql2/commit/0ee20536501848a354f1c3a007333167120c7457
@@ -8,15 +10,31 @@ if GC.respond_to?(:verify_compaction_references)
   GC.verify_compaction_references(double_heap: true, toward: :empty)
 end
 
+# tools/server/server, see "Build and start dummy OPCUA server" in the README
+SERVER_URL = ENV.fetch("OPCUA_SERVER_URL", "opc.tcp://127.0.0.1:4840")
+
+# Examples tagged server: true are skipped when no server answers at
+# SERVER_URL, unless OPCUA_SERVER_URL is set explicitly
+def server_running?
+  return true if ENV["OPCUA_SERVER_URL"]
+
+  host, port = SERVER_URL.sub("opc.tcp://", "").split("/").first.split(":")
+  Socket.tcp(host, (port || 4840).to_i, connect_timeout: 1).close
+  true
+rescue SystemCallError, SocketError
+  false
+end
+
 def new_client(connect: true)
   client = OPCUAClient::Client.new
 
   if connect
-    # TODO
+    client.connect(SERVER_URL)
   end
 
   client
 end
 
 RSpec.configure do |config|
+  config.filter_run_excluding server: true unless server_running?
 end
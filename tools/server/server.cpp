@@ -29,6 +29,15 @@ static UA_NodeId addVariableUnder(UA_Server *server, UA_Int16 nsId, int type, co
     } else if (type == UA_TYPES_BOOLEAN) {
         UA_Boolean initialValue = *(UA_Boolean*)defaultValue;
         UA_Variant_setScalar(&attr.value, &initialValue, &UA_TYPES[type]);
+    } else if (type == UA_TYPES_FLOAT) {
+        UA_Float initialValue = *(UA_Int32*)defaultValue;
+        UA_Variant_setScalar(&attr.value, &initialValue, &UA_TYPES[type]);
+    } else if (type == UA_TYPES_DOUBLE) {
+        UA_Double initialValue = *(UA_Int32*)defaultValue;
+        UA_Variant_setScalar(&attr.value, &initialValue, &UA_TYPES[type]);
+    } else if (type == UA_TYPES_STRING) {
+        UA_String initialValue = UA_STRING_NULL;
+        UA_Variant_setScalar(&attr.value, &initialValue, &UA_TYPES[type]);
     } else {
         throw "type not supported";
     }
@@ -69,6 +78,39 @@ static void addVariableV2(UA_Server *server, UA_Int16 nsId, int type, const char
     UA_NodeId parentNode = addVariable(server, nsId, type, desc, displayName, nodeId, varName, &defaultValue);
 }
 
+static void addArrayVariable(UA_Server *server, UA_Int16 nsId, int type, const char *variable, size_t length) {
+    void *data = UA_Array_new(length, &UA_TYPES[type]);
+
+    for (size_t i = 0; i < length; i++) {
+        if (type == UA_TYPES_FLOAT) {
+            ((UA_Float*)data)[i] = i * 0.5f;
+        } else if (type == UA_TYPES_INT16) {
+            ((UA_Int16*)data)[i] = (UA_Int16)(i - length / 2);
+        } else {
+            throw "type not supported";
+        }
+    }
+
+    UA_VariableAttributes attr = UA_VariableAttributes_default;
+    UA_Variant_setArray(&attr.value, data, length, &UA_TYPES[type]);
+    UA_UInt32 arrayDimensions[1] = { 0 };
+    attr.valueRank = 1;
+    attr.arrayDimensions = arrayDimensions;
+    attr.arrayDimensionsSize = 1;
+    attr.dataType = UA_TYPES[type].typeId;
+    attr.displayName = UA_LOCALIZEDTEXT((char*) "en-US", (char*) variable);
+    attr.accessLevel = UA_ACCESSLEVELMASK_READ | UA_ACCESSLEVELMASK_WRITE;
+
+    UA_Server_addVariableNode(server, UA_NODEID_STRING(nsId, (char*) variable),
+                              UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER),
+                              UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES),
+                              UA_QUALIFIEDNAME(nsId, (char*) variable),
+                              UA_NODEID_NUMERIC(0, UA_NS0ID_BASEDATAVARIABLETYPE),
+                              attr, NULL, NULL);
+
+    UA_Array_delete(data, length, &UA_TYPES[type]);
+}
+
 UA_Boolean running = true;
 static void signalHandler(int signum) {
     UA_LOG_INFO(UA_Log_Stdout, UA_LOGCATEGORY_SERVER, "Signal received: %i", signum);
@@ -89,6 +131,15 @@ static void addVariables(UA_Server *server) {
     addVariableV2(server, ns5Id, UA_TYPES_UINT16, "uint16c", 200);
     addVariableV2(server, ns5Id, UA_TYPES_BOOLEAN, "true_var", true);
     addVariableV2(server, ns5Id, UA_TYPES_BOOLEAN, "false_var", false);
+
+    addVariableV2(server, ns2Id, UA_TYPES_INT16, "int16a");
+    addVariableV2(server, ns2Id, UA_TYPES_INT32, "int32a");
+    addVariableV2(server, ns2Id, UA_TYPES_FLOAT, "floata");
+    addVariableV2(server, ns2Id, UA_TYPES_DOUBLE, "doublea");
+    addVariableV2(server, ns2Id, UA_TYPES_STRING, "stringa");
+
+    addArrayVariable(server, ns5Id, UA_TYPES_FLOAT, "float_array", 100000);
+    addArrayVariable(server, ns5Id, UA_TYPES_INT16, "int16_array", 1000);
 }
 
 int main(void) {